@@ -0,0 +1,258 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "GerdaBank.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "TH1D.h"
+
+namespace {
+    const char magic[8] = {'G', 'E', 'R', 'D', 'A', 'B', 'K', '1'};
+
+    inline uint64_t align8(uint64_t n) { return (n + 7) & ~uint64_t(7); }
+
+    // file part of the key without empty and "." path components, so that
+    // "./a//b.root:h" and "a/b.root:h" are the same key
+    std::string normalize(const std::string& key) {
+        auto colon = key.find(':');
+        auto path = key.substr(0, colon);
+        std::string out;
+        size_t start = 0;
+        while (start <= path.size()) {
+            auto end = std::min(path.find('/', start), path.size());
+            auto comp = path.substr(start, end - start);
+            if (!comp.empty() and comp != ".") {
+                if (!out.empty()) out += '/';
+                out += comp;
+            }
+            start = end + 1;
+        }
+        return colon == std::string::npos ? out : out + key.substr(colon);
+    }
+}
+
+struct GerdaBank::header {
+    char magic[8];
+    uint64_t n_entries;
+    // total file size, to detect truncated files
+    uint64_t size;
+    uint64_t reserved;
+};
+
+struct GerdaBank::entry {
+    // offsets are from the beginning of the file
+    uint64_t key;
+    uint32_t key_length;
+    int32_t nbins;
+    double xmin;
+    double xmax;
+    // nbins+1 edges, 0 for fixed-width bins
+    uint64_t edges;
+    // nbins+2 contents
+    uint64_t contents;
+};
+
+GerdaBank::GerdaBank(const std::string& filename) :
+    _filename(filename),
+    _data(nullptr),
+    _size(0),
+    _n(0),
+    _entries(nullptr) {
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("GerdaBank::GerdaBank] could not open " + filename + ".");
+    struct stat st;
+    if (fstat(fd, &st) != 0 or st.st_size < static_cast<off_t>(sizeof(header))) {
+        close(fd);
+        throw std::runtime_error("GerdaBank::GerdaBank] " + filename + " is not a distortion bank.");
+    }
+    _size = st.st_size;
+    auto addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) throw std::runtime_error("GerdaBank::GerdaBank] could not map " + filename + " in memory.");
+    _data = static_cast<const char*>(addr);
+
+    auto h = reinterpret_cast<const header*>(_data);
+    if (std::memcmp(h->magic, magic, sizeof(magic)) != 0 or h->size != _size
+        or h->n_entries > (_size - sizeof(header))/sizeof(entry)) {
+        munmap(addr, _size);
+        throw std::runtime_error("GerdaBank::GerdaBank] " + filename + " is not a distortion bank or is corrupted.");
+    }
+    _n = h->n_entries;
+    _entries = reinterpret_cast<const entry*>(_data + sizeof(header));
+
+    // all the offsets are checked here once, Find() and Get() trust them
+    auto fits = [this](uint64_t offset, uint64_t n, uint64_t size) {
+        return offset <= _size and n <= (_size - offset)/size;
+    };
+    for (size_t i = 0; i < _n; ++i) {
+        auto& e = _entries[i];
+        bool ok = e.nbins >= 1 and fits(e.key, e.key_length, 1)
+            and e.contents % 8 == 0 and fits(e.contents, uint64_t(e.nbins) + 2, sizeof(double))
+            and (e.edges == 0 or (e.edges % 8 == 0 and fits(e.edges, uint64_t(e.nbins) + 1, sizeof(double))));
+        if (ok and i > 0) {
+            auto& p = _entries[i-1];
+            auto c = std::memcmp(_data + p.key, _data + e.key, std::min(p.key_length, e.key_length));
+            ok = c < 0 or (c == 0 and p.key_length < e.key_length);
+        }
+        if (!ok) {
+            munmap(addr, _size);
+            throw std::runtime_error("GerdaBank::GerdaBank] " + filename + " is corrupted (entry " + std::to_string(i) + ").");
+        }
+    }
+}
+
+GerdaBank::~GerdaBank() {
+    if (_data) munmap(const_cast<char*>(_data), _size);
+}
+
+const GerdaBank::entry* GerdaBank::Find(const std::string& k) const {
+    auto key = normalize(k);
+    auto less = [this](const entry& e, const std::string& k) {
+        auto n = std::min<size_t>(e.key_length, k.size());
+        auto c = std::memcmp(_data + e.key, k.data(), n);
+        return c < 0 or (c == 0 and e.key_length < k.size());
+    };
+    auto it = std::lower_bound(_entries, _entries + _n, key, less);
+    if (it == _entries + _n or it->key_length != key.size()
+        or std::memcmp(_data + it->key, key.data(), key.size()) != 0) return nullptr;
+    return it;
+}
+
+bool GerdaBank::Has(const std::string& key) const {
+    return this->Find(key) != nullptr;
+}
+
+std::unique_ptr<TH1> GerdaBank::Get(const std::string& key) const {
+    auto e = this->Find(key);
+    if (!e) return nullptr;
+
+    // named after the object, as if read from the ROOT file
+    auto name = key.substr(key.find_last_of(":/") + 1);
+
+    TH1::AddDirectory(false);
+    auto h = e->edges != 0 ?
+        new TH1D(name.c_str(), "", e->nbins, reinterpret_cast<const double*>(_data + e->edges)) :
+        new TH1D(name.c_str(), "", e->nbins, e->xmin, e->xmax);
+
+    auto c = reinterpret_cast<const double*>(_data + e->contents);
+    std::copy(c, c + e->nbins + 2, h->GetArray());
+    return std::unique_ptr<TH1>(h);
+}
+
+std::vector<std::string> GerdaBank::GetKeys() const {
+    std::vector<std::string> keys;
+    keys.reserve(_n);
+    for (size_t i = 0; i < _n; ++i) keys.emplace_back(_data + _entries[i].key, _entries[i].key_length);
+    return keys;
+}
+
+bool GerdaBank::IsBank(const std::string& filename) {
+    std::ifstream f(filename, std::ios::binary);
+    char m[sizeof(magic)];
+    if (!f.read(m, sizeof(m))) return false;
+    return std::memcmp(m, magic, sizeof(magic)) == 0;
+}
+
+void GerdaBank::Write(const std::string& filename, const std::vector<std::pair<std::string, const TH1*>>& hists) {
+
+    std::vector<std::string> keys;
+    for (auto& h : hists) keys.push_back(normalize(h.first));
+    std::vector<size_t> order(hists.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+    for (size_t i = 1; i < order.size(); ++i) {
+        if (keys[order[i]] == keys[order[i-1]]) {
+            throw std::runtime_error("GerdaBank::Write] duplicated key '" + keys[order[i]] + "'.");
+        }
+    }
+
+    // lay out the file: index, then keys, then the arrays
+    std::vector<entry> index(order.size());
+    uint64_t offset = sizeof(header) + index.size()*sizeof(entry);
+    for (size_t i = 0; i < order.size(); ++i) {
+        auto& key = keys[order[i]];
+        index[i].key = offset;
+        index[i].key_length = key.size();
+        offset += key.size();
+    }
+    offset = align8(offset);
+    for (size_t i = 0; i < order.size(); ++i) {
+        auto h = hists[order[i]].second;
+        if (!h or h->GetDimension() != 1) {
+            throw std::runtime_error("GerdaBank::Write] '" + keys[order[i]] + "' is not a 1D histogram.");
+        }
+        auto& e = index[i];
+        auto axis = h->GetXaxis();
+        e.nbins = h->GetNbinsX();
+        e.xmin = axis->GetXmin();
+        e.xmax = axis->GetXmax();
+        e.edges = 0;
+        if (axis->GetXbins()->GetSize() > 0) {
+            e.edges = offset;
+            offset += (e.nbins + 1)*sizeof(double);
+        }
+        e.contents = offset;
+        offset += (e.nbins + 2)*sizeof(double);
+    }
+
+    header head;
+    std::memcpy(head.magic, magic, sizeof(magic));
+    head.n_entries = index.size();
+    head.size = offset;
+    head.reserved = 0;
+
+    std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+    if (!f.is_open()) throw std::runtime_error("GerdaBank::Write] could not open " + filename + " for writing.");
+
+    f.write(reinterpret_cast<const char*>(&head), sizeof(head));
+    f.write(reinterpret_cast<const char*>(index.data()), index.size()*sizeof(entry));
+    for (auto i : order) f.write(keys[i].data(), keys[i].size());
+    const char pad[8] = {};
+    const uint64_t pos = f.tellp();
+    f.write(pad, align8(pos) - pos);
+
+    std::vector<double> buf;
+    for (size_t i = 0; i < order.size(); ++i) {
+        auto h = hists[order[i]].second;
+        auto& e = index[i];
+        if (e.edges != 0) {
+            auto edges = h->GetXaxis()->GetXbins();
+            f.write(reinterpret_cast<const char*>(edges->GetArray()), (e.nbins + 1)*sizeof(double));
+        }
+        buf.resize(e.nbins + 2);
+        for (int b = 0; b < e.nbins + 2; ++b) buf[b] = h->GetBinContent(b);
+        f.write(reinterpret_cast<const char*>(buf.data()), buf.size()*sizeof(double));
+    }
+
+    if (!f) throw std::runtime_error("GerdaBank::Write] error while writing " + filename + ".");
+}
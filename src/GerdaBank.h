@@ -0,0 +1,82 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef _GERDA_BANK_H
+#define _GERDA_BANK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include "TH1.h"
+
+// Read-only, memory-mapped collection of 1D histograms in a single binary
+// file, looked up by key. Keys are "path/to/file.root:object/path", with the
+// file path relative to the packed folder, so that a folder of ROOT files
+// (e.g. the distortions computed by data/compute-distortions) can be replaced
+// by one bank. Opening a bank maps the file and checks its index, histograms
+// are read only when requested
+//
+// Layout (native endianness, 8 byte aligned): header, index of entries
+// sorted by key, keys, bin edges and bin contents (flow bins included)
+class GerdaBank {
+
+    public:
+
+    // delete dangerous constructors
+    GerdaBank           (GerdaBank const&) = delete;
+    GerdaBank& operator=(GerdaBank const&) = delete;
+
+    explicit GerdaBank(const std::string& filename);
+    ~GerdaBank();
+
+    inline const std::string& GetFileName() const { return _filename; }
+    inline size_t GetSize() const { return _n; }
+
+    bool Has(const std::string& key) const;
+    // a new (caller-owned) TH1D, nullptr if the key is not in the bank
+    std::unique_ptr<TH1> Get(const std::string& key) const;
+    std::vector<std::string> GetKeys() const;
+
+    // true if filename exists and looks like a bank
+    static bool IsBank(const std::string& filename);
+    // writes the (key, histogram) pairs to a new bank. Keys must be unique
+    static void Write(const std::string& filename, const std::vector<std::pair<std::string, const TH1*>>& hists);
+
+    private:
+
+    struct header;
+    struct entry;
+
+    const entry* Find(const std::string& key) const;
+
+    std::string _filename;
+    const char* _data;
+    size_t _size;
+    size_t _n;
+    const entry* _entries;
+};
+
+#endif
@@ -22,9 +22,11 @@
 
 #include "GerdaFactory.h"
 #include <iostream>
+#include <algorithm>
 
 GerdaFactory::GerdaFactory() :
-    _rndgen(0),
+    _rndgen(),
+    _mode(alias),
     _range(0, 0) {
 
     TH1::AddDirectory(false);
@@ -34,6 +36,21 @@ void GerdaFactory::SetCountsRange(float xmin, float xmax) {
     if (!(xmin == 0 and xmax == 0) and xmax < xmin) throw std::runtime_error("GerdaFactory::SetCountsRange] invalid range.");
     _range.first = xmin;
     _range.second = xmax;
+    for (auto& comp : _comp_list) this->UpdateTotal(comp);
+}
+
+// expectation over the whole histogram, given the one in the counts range
+void GerdaFactory::UpdateTotal(component& comp) const {
+    auto& hist = *comp.hist;
+    if (comp.counts == 0 or (_range.first == 0 and _range.second == 0)) {
+        comp.total = comp.counts;
+        return;
+    }
+
+    auto axis = hist.GetXaxis();
+    auto in_range = sparse::integral(hist, comp.support, axis->FindBin(_range.first), axis->FindBin(_range.second));
+    if (!(in_range > 0)) throw std::runtime_error("GerdaFactory::UpdateTotal] histogram has null integral in the counts range.");
+    comp.total = comp.counts * sparse::integral(hist, comp.support) / in_range;
 }
 
 // creates an internal copy of the histogram pointer
@@ -41,9 +58,25 @@ void GerdaFactory::AddComponent(const TH1* hist, const float counts) {
     if (!hist) throw std::runtime_error("GerdaFactory::AddComponent] invalid pointer detected.");
     if (counts < 0) throw std::runtime_error("GerdaFactory::AddComponent] counts argument is < 0.");
 
-    // insert clone
+    // insert clone, together with its alias table (built once here)
     std::unique_ptr<TH1> _tmp(dynamic_cast<TH1*>(hist->Clone(("comp_" + std::to_string(_comp_list.size())).c_str())));
-    _comp_list.emplace(std::move(_tmp), counts);
+    sampling::alias_table _sampler(*_tmp);
+    if (_sampler.empty() and counts > 0) throw std::runtime_error("GerdaFactory::AddComponent] histogram has null integral.");
+
+    // conditional bin probabilities p_i / sum_{j >= i} p_j
+    std::vector<double> _cond_prob(_tmp->GetNbinsX());
+    double _tail = 0;
+    for (int b = _tmp->GetNbinsX(); b >= 1; --b) {
+        auto _p = std::max(_tmp->GetBinContent(b), 0.);
+        _tail += _p;
+        _cond_prob[b-1] = _tail > 0 ? std::min(_p/_tail, 1.) : 0;
+    }
+
+    auto _support = sparse::index(*_tmp);
+
+    component _comp{std::move(_tmp), counts, 0, std::move(_sampler), std::move(_cond_prob), std::move(_support), {}, false};
+    this->UpdateTotal(_comp);
+    _comp_list.push_back(std::move(_comp));
 }
 
 // creates an internal copy of the histogram pointer
@@ -55,38 +88,171 @@ void GerdaFactory::FillPseudoExp(TH1& out) {
 
     if (_comp_list.empty()) throw std::runtime_error("GerdaFactory::GetPseudoExp] must call GerdaFactory::AddComponent first.");
 
+    // events are counted directly in the output bins when possible, the
+    // histogram is updated once at the end
+    this->UpdateBinMaps(*out.GetXaxis());
+    std::fill(_counts.begin(), _counts.end(), 0);
+    bool counted = false;
+
     // loop over components in list
     for (auto& comp : _comp_list) {
+        auto& hist = *comp.hist;
+        auto& sampler = comp.sampler;
+
         // determine experiment actualization
         int real_cts;
-        if (_range.first == 0 and _range.second == 0) real_cts = _rndgen.Poisson(comp.second);
-        else real_cts = _rndgen.Poisson(comp.second)*comp.first->Integral()/comp.first->Integral(_range.first, _range.second);
+        sampling::poisson(_rndgen, comp.total, &real_cts, 1);
 
         // and fill the provided TH1
-        for (int i = 0; i < real_cts; ++i) {
-            out.Fill(comp.first->GetRandom());
+        if (_mode == multinomial) {
+            if (!comp.out_nested) {
+                throw std::runtime_error("GerdaFactory::FillPseudoExp] output binning is incompatible with multinomial generation.");
+            }
+            this->FillMultinomial(comp, real_cts);
+            counted = true;
+        }
+        else if (_mode == get_random) {
+            // TH1::GetRandom() draws from gRandom, point it to our stream
+            auto _grandom = gRandom;
+            gRandom = &_rndgen;
+            for (int i = 0; i < real_cts; ++i) out.Fill(hist.GetRandom());
+            gRandom = _grandom;
+        }
+        else if (comp.out_nested) {
+            // the position inside the bin does not matter
+            for (int i = 0; i < real_cts; ++i) ++_counts[comp.out_bin[sampler.sample(_rndgen)-1]];
+            counted = true;
         }
+        else if (real_cts > 0) {
+            // pick a bin from the alias table, then a uniform position
+            // inside it, as TH1::GetRandom() does
+            auto axis = hist.GetXaxis();
+            for (int i = 0; i < real_cts; ++i) {
+                auto b = sampler.sample(_rndgen);
+                out.Fill(axis->GetBinUpEdge(b) - axis->GetBinWidth(b)*_rndgen.Rndm());
+            }
+        }
+    }
+
+    if (counted) {
+        // unit weights, as Fill() would add them to the squared sums too
+        auto sumw2 = out.GetSumw2N() > 0 ? out.GetSumw2() : nullptr;
+        for (size_t b = 0; b < _counts.size(); ++b) {
+            if (_counts[b] > 0) {
+                out.AddBinContent(b, _counts[b]);
+                if (sumw2) (*sumw2)[b] += _counts[b];
+            }
+        }
+        // bin contents were set directly, recompute statistics from them
+        out.ResetStats();
     }
 }
 
-void GerdaFactory::FillPseudoExp(TH1* out) {
+void GerdaFactory::GenerateEvents(const event_sink& sink, int chunk_size) {
 
-    if (_comp_list.empty()) throw std::runtime_error("GerdaFactory::GetPseudoExp] must call GerdaFactory::AddComponent first.");
+    if (_comp_list.empty()) throw std::runtime_error("GerdaFactory::GenerateEvents] must call GerdaFactory::AddComponent first.");
+    if (chunk_size < 1) throw std::runtime_error("GerdaFactory::GenerateEvents] chunk size is < 1.");
+
+    _events.resize(chunk_size);
+
+    for (size_t c = 0; c < _comp_list.size(); ++c) {
+        auto& comp = _comp_list[c];
+        auto& hist = *comp.hist;
+        auto axis = hist.GetXaxis();
 
-    // loop over components in list
-    for (auto& comp : _comp_list) {
-        // determine experiment actualization
         int real_cts;
-        if (_range.first == 0 and _range.second == 0) real_cts = _rndgen.Poisson(comp.second);
-        else real_cts = _rndgen.Poisson(comp.second)*comp.first->Integral()/comp.first->Integral(_range.first, _range.second);
+        sampling::poisson(_rndgen, comp.total, &real_cts, 1);
 
-        // and fill the provided TH1
-        for (int i = 0; i < real_cts; ++i) {
-            out->Fill(comp.first->GetRandom());
+        int n = 0;
+        auto push = [&](double energy) {
+            _events[n++] = energy;
+            if (n == chunk_size) { sink(c, _events.data(), n); n = 0; }
+        };
+        // uniform position inside bin b, as TH1::GetRandom() does
+        auto in_bin = [&](int b) { return axis->GetBinUpEdge(b) - axis->GetBinWidth(b)*_rndgen.Rndm(); };
+
+        if (_mode == multinomial) {
+            // bin counts as in FillMultinomial(), then the positions
+            int left = real_cts;
+            for (auto r = comp.support.ranges.begin(); r != comp.support.ranges.end() and left > 0; ++r) {
+                for (int b = r->first; b <= r->second and left > 0; ++b) {
+                    auto nb = sampling::binomial(_rndgen, left, comp.cond_prob[b-1]);
+                    for (int i = 0; i < nb; ++i) push(in_bin(b));
+                    left -= nb;
+                }
+            }
+        }
+        else if (_mode == get_random) {
+            auto _grandom = gRandom;
+            gRandom = &_rndgen;
+            for (int i = 0; i < real_cts; ++i) push(hist.GetRandom());
+            gRandom = _grandom;
+        }
+        else {
+            for (int i = 0; i < real_cts; ++i) push(in_bin(comp.sampler.sample(_rndgen)));
         }
+
+        if (n > 0) sink(c, _events.data(), n);
+    }
+}
+
+// maps are recomputed only if the output binning changed
+void GerdaFactory::UpdateBinMaps(const TAxis& out_axis) {
+
+    const int nout = out_axis.GetNbins();
+    bool same = static_cast<int>(_map_edges.size()) == nout+1;
+    for (int b = 1; same and b <= nout+1; ++b) same = _map_edges[b-1] == out_axis.GetBinLowEdge(b);
+
+    // components added since the last call have no map yet
+    if (same) {
+        for (auto& comp : _comp_list) same = same and !comp.out_bin.empty();
+        if (same) return;
     }
+
+    _map_edges.resize(nout+1);
+    for (int b = 1; b <= nout+1; ++b) _map_edges[b-1] = out_axis.GetBinLowEdge(b);
+    _counts.assign(nout+2, 0);
+
+    for (auto& comp : _comp_list) {
+        auto axis = comp.hist->GetXaxis();
+        const int n = axis->GetNbins();
+        comp.out_bin.resize(n);
+        for (int b = 1; b <= n; ++b) comp.out_bin[b-1] = out_axis.FindFixBin(axis->GetBinCenter(b));
+
+        // empty bins are never drawn and need not be nested
+        comp.out_nested = true;
+        for (auto& r : comp.support.ranges) {
+            for (int b = r.first; b <= r.second and comp.out_nested; ++b) {
+                auto width = axis->GetBinWidth(b);
+                comp.out_nested = out_axis.FindFixBin(axis->GetBinLowEdge(b) + 1e-6*width) ==
+                                  out_axis.FindFixBin(axis->GetBinUpEdge(b) - 1e-6*width);
+            }
+        }
+    }
+}
+
+// split real_cts events among the component bins with a chain of binomials,
+// n_i ~ B(n - sum_{j < i} n_j, p_i / sum_{j >= i} p_j), which gives the same
+// bin counts as drawing the events one by one
+void GerdaFactory::FillMultinomial(const component& comp, int real_cts) {
+
+    // empty bins have zero conditional probability and are skipped
+    int left = real_cts;
+    for (auto r = comp.support.ranges.begin(); r != comp.support.ranges.end() and left > 0; ++r) {
+        for (int b = r->first; b <= r->second and left > 0; ++b) {
+            auto nb = sampling::binomial(_rndgen, left, comp.cond_prob[b-1]);
+            _counts[comp.out_bin[b-1]] += nb;
+            left -= nb;
+        }
+    }
+}
+
+void GerdaFactory::FillPseudoExp(TH1* out) {
+    if (!out) throw std::runtime_error("GerdaFactory::FillPseudoExp] invalid pointer detected.");
+    this->FillPseudoExp(*out);
 }
 
 void GerdaFactory::ResetComponents() {
     _comp_list.clear();
+    _map_edges.clear();
 }
@@ -24,16 +24,27 @@
 #define _GERDA_FACTORY_H
 
 #include <vector>
-#include <map>
 #include <memory>
+#include <functional>
 
 #include "TH1.h"
-#include "TRandom3.h"
+
+#include "GerdaSampling.h"
+#include "GerdaRandom.h"
+#include "GerdaSupport.h"
 
 class GerdaFactory {
 
     public:
 
+    // how single events are drawn from the component PDFs
+    enum gen_mode {
+        get_random, // TH1::GetRandom(), binary search over the cumulative
+        alias,      // precomputed alias table, O(1) per event
+        multinomial // bin counts drawn directly, O(nbins) per component.
+                    // output bins must be unions of component bins
+    };
+
     // delete dangerous constructors
     GerdaFactory           (GerdaFactory const&) = delete;
     GerdaFactory& operator=(GerdaFactory const&) = delete;
@@ -41,17 +52,67 @@ class GerdaFactory {
     // custom constructor
     GerdaFactory();
 
+    inline void SetGenMode(gen_mode mode) { _mode = mode; }
+    inline gen_mode GetGenMode() const { return _mode; }
+
+    // random numbers of experiment i depend only on (seed, i)
+    inline void SetSeed(ULong64_t seed) { _rndgen.SetSeed(seed); }
+    inline ULong64_t GetSeed() const { return _rndgen.GetGlobalSeed(); }
+    inline void SetExperimentIndex(UInt_t i) { _rndgen.SetStream(i, GerdaRandom::toy); }
+
+    // components added before are renormalized to the new range
     void SetCountsRange(float xmin, float xmax);
+    // counts are expected in the counts range, if set
     void AddComponent(const TH1* hist, const float counts);
     void AddComponent(const std::unique_ptr<TH1>& hist, const float counts);
     void FillPseudoExp(TH1* experiment);
     void FillPseudoExp(TH1& experiment);
+
+    // receives the energies of n events from the component with the given
+    // index (in insertion order)
+    typedef std::function<void(int comp, const float* energies, int n)> event_sink;
+    // unbinned experiment: the events are passed to sink in chunks of at
+    // most chunk_size, which bounds the memory needed for any number of
+    // events. In multinomial mode they come ordered by bin
+    void GenerateEvents(const event_sink& sink, int chunk_size = 4096);
+
     void ResetComponents();
 
     private:
 
-    TRandom3 _rndgen;
-    std::map<std::unique_ptr<TH1>, float> _comp_list;
+    // everything the generation needs, computed once in AddComponent() (or
+    // SetCountsRange()) and not per experiment
+    struct component {
+        std::unique_ptr<TH1> hist;
+        // expected counts in the counts range and in the whole histogram
+        float counts;
+        double total;
+        sampling::alias_table sampler;
+        // probability of each bin conditioned to the event not falling in
+        // any of the previous ones, for the multinomial splitting
+        std::vector<double> cond_prob;
+        sparse::support support;
+        // output bin (flow bins included) of each bin b at index b-1, valid
+        // if out_nested, i.e. if each non-empty bin falls entirely into one
+        // output bin. See UpdateBinMaps()
+        std::vector<int> out_bin;
+        bool out_nested;
+    };
+
+    void UpdateTotal(component& comp) const;
+    void UpdateBinMaps(const TAxis& out_axis);
+    void FillMultinomial(const component& comp, int real_cts);
+
+    GerdaRandom _rndgen;
+    gen_mode _mode;
+    // in insertion order
+    std::vector<component> _comp_list;
+    // bin edges of the output the bin maps were computed for
+    std::vector<double> _map_edges;
+    // per-experiment counts in the output bins, flow bins included
+    std::vector<int> _counts;
+    // chunk buffer for GenerateEvents()
+    std::vector<float> _events;
     std::pair<float, float> _range;
 };
 
@@ -23,10 +23,16 @@
 #include "GerdaFastFactory.h"
 
 #include <stdexcept>
+#include <string>
+#include <algorithm>
 
 GerdaFastFactory::GerdaFastFactory() :
-    _rndgen(0),
-    _range(0, 0) {
+    _rndgen(),
+    _range(0, 0),
+    _empty(true),
+    _ngroup(1),
+    _means_stale(true),
+    _use_tables(false) {
 
     TH1::AddDirectory(false);
 }
@@ -37,41 +43,273 @@ void GerdaFastFactory::SetCountsRange(float xmin, float xmax) {
     _range.second = xmax;
 }
 
+void GerdaFastFactory::SetRebinFactor(int ngroup) {
+    if (ngroup < 1) throw std::runtime_error("GerdaFastFactory::SetRebinFactor] invalid rebin factor.");
+    _ngroup = ngroup;
+    _means_stale = true;
+}
+
 void GerdaFastFactory::AddComponent(const TH1* hist, const float counts) {
     if (!hist) throw std::runtime_error("GerdaFastFactory::AddComponent] invalid pointer detected.");
-    if (counts < 0) throw std::runtime_error("GerdaFastFactory::AddComponent] weight is < 0.");
+    this->AddComponent(hist, counts, sparse::index(*hist));
+}
 
-    // clone
-    std::unique_ptr<TH1> htmp(dynamic_cast<TH1*>(hist->Clone()));
+void GerdaFastFactory::AddComponent(const TH1* hist, const float counts, const sparse::support& supp) {
+    if (!hist) throw std::runtime_error("GerdaFastFactory::AddComponent] invalid pointer detected.");
+    if (counts < 0) throw std::runtime_error("GerdaFastFactory::AddComponent] weight is < 0.");
+    if (supp.nbins != hist->GetNbinsX()) throw std::runtime_error("GerdaFastFactory::AddComponent] support does not match the histogram binning.");
 
-    // normalize to requested weight
-    if (_range.first == 0 and _range.second == 0) htmp->Scale(counts/htmp->Integral());
-    else htmp->Scale(counts/htmp->Integral(htmp->GetXaxis()->FindBin(_range.first), htmp->GetXaxis()->FindBin(_range.second)));
+    // normalization to requested weight
+    auto norm = this->GetNormalization(*hist, supp);
+    if (counts > 0 and !(norm > 0)) throw std::runtime_error("GerdaFastFactory::AddComponent] histogram has null integral in the counts range.");
 
-    // initialize total model, if needed
-    if (_model == nullptr) {
+    // initialize total model, if needed. The one from before the last Reset()
+    // is reused if the binning did not change
+    auto axis = hist->GetXaxis();
+    if (_model == nullptr or _model->GetNbinsX() != hist->GetNbinsX() or
+        _model->GetXaxis()->GetXmin() != axis->GetXmin() or
+        _model->GetXaxis()->GetXmax() != axis->GetXmax()) {
+        if (!_empty) throw std::runtime_error("GerdaFastFactory::AddComponent] histogram binning differs from the one of the components added before.");
         _model = std::unique_ptr<TH1>(dynamic_cast<TH1*>(hist->Clone("model")));
         _model->Reset();
+        _model_support = sparse::support();
+    }
+
+    // add (scaled) without cloning, on the non-empty bins only
+    auto weight = counts > 0 ? counts/norm : 0;
+    sparse::add(*_model, *hist, weight, supp);
+    _components.emplace_back(hist, weight);
+    _model_support.merge(supp);
+    _empty = false;
+    _means_stale = true;
+}
+
+double GerdaFastFactory::GetNormalization(const TH1& hist, const sparse::support& supp) const {
+    if (_range.first == 0 and _range.second == 0) return sparse::integral(hist, supp);
+    auto axis = hist.GetXaxis();
+    return sparse::integral(hist, supp, axis->FindBin(_range.first), axis->FindBin(_range.second));
+}
+
+void GerdaFastFactory::SetBase() {
+    if (_empty) throw std::runtime_error("GerdaFastFactory::SetBase] must call GerdaFastFactory::AddComponent first.");
+    // the shapes of replaced components are not kept, see ReplaceComponent()
+    if (std::find(_replaced.begin(), _replaced.end(), true) != _replaced.end()) {
+        throw std::runtime_error("GerdaFastFactory::SetBase] model has replaced components, must call GerdaFastFactory::ResetToBase first.");
+    }
+    _base = std::unique_ptr<TH1>(dynamic_cast<TH1*>(_model->Clone("base_model")));
+    _base_support = _model_support;
+    _base_components = _components;
+}
+
+void GerdaFastFactory::ResetToBase() {
+    if (!_base) throw std::runtime_error("GerdaFastFactory::ResetToBase] must call GerdaFastFactory::SetBase first.");
+
+    // the model keeps the base binning, see AddComponent()
+    this->Reset();
+    if (!_model or _model->GetNbinsX() != _base->GetNbinsX()) _model = std::unique_ptr<TH1>(dynamic_cast<TH1*>(_base->Clone("model")));
+    else sparse::add(*_model, *_base, 1, _base_support);
+    _model_support = _base_support;
+    _components = _base_components;
+    _replaced.assign(_base_components.size(), false);
+    _empty = false;
+    _means_stale = true;
+}
+
+void GerdaFastFactory::ReplaceComponent(size_t i, const TH1* new_hist, const float counts, const sparse::support& supp) {
+    if (!new_hist) throw std::runtime_error("GerdaFastFactory::ReplaceComponent] invalid pointer detected.");
+    if (_empty or i >= _replaced.size()) throw std::runtime_error("GerdaFastFactory::ReplaceComponent] no such base component, must call GerdaFastFactory::ResetToBase first.");
+    if (_replaced[i]) throw std::runtime_error("GerdaFastFactory::ReplaceComponent] component already replaced since last GerdaFastFactory::ResetToBase.");
+    if (counts < 0) throw std::runtime_error("GerdaFastFactory::ReplaceComponent] weight is < 0.");
+    auto old_hist = _base_components[i].first;
+    if (supp.nbins != _model->GetNbinsX() or old_hist->GetNbinsX() != supp.nbins or new_hist->GetNbinsX() != supp.nbins) {
+        throw std::runtime_error("GerdaFastFactory::ReplaceComponent] histograms do not match the model binning.");
     }
 
-    // add
-    _model->Add(htmp.get());
+    auto new_norm = this->GetNormalization(*new_hist, supp);
+    if (counts > 0 and !(new_norm > 0)) {
+        throw std::runtime_error("GerdaFastFactory::ReplaceComponent] histogram has null integral in the counts range.");
+    }
+    auto weight = counts > 0 ? counts/new_norm : 0;
+
+    // supp must cover both shapes, i.e. be the support the component was
+    // added with (distortions do not extend it). The normalization of the
+    // base shape is known since SetBase(). new_hist is not referenced after
+    // the call: a component is replaced at most once per ResetToBase()
+    sparse::add(*_model, *new_hist, weight, *old_hist, -_base_components[i].second, supp);
+    _replaced[i] = true;
+    _means_stale = true;
+}
+
+void GerdaFastFactory::AddToModel(const TH1& x, double a, const TH1& y, double b, const sparse::support& supp) {
+    if (_empty or !_model) throw std::runtime_error("GerdaFastFactory::AddToModel] must call GerdaFastFactory::AddComponent first.");
+    sparse::add(*_model, x, a, y, b, supp);
+    _model_support.merge(supp);
+    _means_stale = true;
+}
+
+void GerdaFastFactory::AddProductToModel(const TH1& x, const TH1& y, double a, double b, const sparse::support& supp) {
+    if (_empty or !_model) throw std::runtime_error("GerdaFastFactory::AddProductToModel] must call GerdaFastFactory::AddComponent first.");
+    sparse::add_product(*_model, x, y, a, b, supp);
+    _model_support.merge(supp);
+    _means_stale = true;
+}
+
+void GerdaFastFactory::AddComponent(const std::unique_ptr<TH1>& hist, const float counts) {
+    this->AddComponent(hist.get(), counts);
 }
 
 std::unique_ptr<TH1> GerdaFastFactory::GetPseudoExp() {
 
-  if (!_model.get()) throw std::runtime_error("GerdaFastFactory::FillPseudoExp] must call GerdaFastFactory::AddComponent first.");
+  if (_empty) throw std::runtime_error("GerdaFastFactory::GetPseudoExp] must call GerdaFastFactory::AddComponent first.");
+  if (!_model) throw std::runtime_error("GerdaFastFactory::GetPseudoExp] no model histogram to take the binning from, use FillPseudoExp().");
 
   auto out = std::unique_ptr<TH1>(dynamic_cast<TH1*>(_model->Clone("pseudo_exp")));
-  out->Reset();
+  if (_ngroup > 1) out->Rebin(_ngroup);
+  this->FillPseudoExp(*out);
+
+  return out;
+}
+
+void GerdaFastFactory::FillPseudoExp(TH1& out) {
 
-  for (int b = 1; b <= out->GetNbinsX(); ++b) {
-    out->SetBinContent(b, _rndgen.Poisson(_model->GetBinContent(b)));
+  if (_empty) throw std::runtime_error("GerdaFastFactory::FillPseudoExp] must call GerdaFastFactory::AddComponent first.");
+  this->UpdateMeans();
+  const int nbins = _means.size();
+
+  if (out.GetNbinsX() != nbins) {
+    throw std::runtime_error("GerdaFastFactory::FillPseudoExp] output histogram has a different number of bins than the (rebinned) model.");
   }
 
-  return out;
+  this->DrawCounts(_counts.data());
+
+  // reset contents and statistics only, keep anything else attached to out
+  out.Reset("ICES");
+  for (auto& r : _means_support.ranges) {
+    for (int b = r.first; b <= r.second; ++b) out.SetBinContent(b, _counts[b-1]);
+  }
 }
 
+void GerdaFastFactory::FillPseudoExp(int* counts) {
+
+  if (_empty) throw std::runtime_error("GerdaFastFactory::FillPseudoExp] must call GerdaFastFactory::AddComponent first.");
+  if (!counts) throw std::runtime_error("GerdaFastFactory::FillPseudoExp] invalid pointer detected.");
+
+  this->UpdateMeans();
+  this->DrawCounts(counts);
+}
+
+std::vector<int> GerdaFastFactory::GenerateBatch(int n) {
+
+  if (_empty) throw std::runtime_error("GerdaFastFactory::GenerateBatch] must call GerdaFastFactory::AddComponent first.");
+  if (n < 0) throw std::runtime_error("GerdaFastFactory::GenerateBatch] number of experiments is < 0.");
+
+  this->UpdateMeans();
+  std::vector<int> counts(static_cast<size_t>(n) * _means.size());
+  this->GenerateBatch(n, counts.data());
+  return counts;
+}
+
+void GerdaFastFactory::GenerateBatch(int n, int* counts) {
+
+  if (_empty) throw std::runtime_error("GerdaFastFactory::GenerateBatch] must call GerdaFastFactory::AddComponent first.");
+  if (!counts) throw std::runtime_error("GerdaFastFactory::GenerateBatch] invalid pointer detected.");
+
+  this->UpdateMeans();
+  const int nbins = _means.size();
+
+  // bin-major: each expectation is loaded (and the Poisson setup done) once,
+  // then the whole column of the matrix is filled. Columns outside of the
+  // model support are zero
+  int next = 0;
+  for (auto& r : _means_support.ranges) {
+    for (int b = next; b < r.first-1; ++b) sampling::poisson(_rndgen, 0, counts + b, n, nbins);
+    for (int b = r.first-1; b < r.second; ++b) sampling::poisson(_rndgen, _means[b], counts + b, n, nbins);
+    next = r.second;
+  }
+  for (int b = next; b < nbins; ++b) sampling::poisson(_rndgen, 0, counts + b, n, nbins);
+}
+
+// Poisson counts for all the (rebinned) model bins, drawn on its support only
+void GerdaFastFactory::DrawCounts(int* counts) {
+  if (_use_tables) {
+    if (_tables.empty()) _tables.build(_means.data(), _means.size());
+    _tables.draw(_rndgen, counts);
+    return;
+  }
+
+  int next = 0;
+  for (auto& r : _means_support.ranges) {
+    std::fill(counts + next, counts + r.first-1, 0);
+    sampling::poisson(_rndgen, _means.data() + r.first-1, counts + r.first-1, r.second - r.first + 1);
+    next = r.second;
+  }
+  std::fill(counts + next, counts + _means.size(), 0);
+}
+
+void GerdaFastFactory::UpdateMeans() {
+  if (!_means_stale) return;
+  if (!_model) throw std::runtime_error("GerdaFastFactory::UpdateMeans] no model histogram, must call GerdaFastFactory::AddComponent first.");
+
+  const int n_orig_bins = _model->GetNbinsX();
+  if (n_orig_bins % _ngroup != 0) {
+    throw std::runtime_error("GerdaFastFactory::UpdateMeans] rebin factor " + std::to_string(_ngroup)
+                             + " is incompatible with the model number of bins (" + std::to_string(n_orig_bins) + ").");
+  }
+
+  // rebinning is done here, once per model
+  const int nbins = n_orig_bins / _ngroup;
+  _prev_means.swap(_means);
+  _means.assign(nbins, 0);
+  _counts.resize(nbins);
+  for (auto& r : _model_support.ranges) {
+    for (int b = r.first; b <= r.second; ++b) _means[(b-1)/_ngroup] += _model->GetBinContent(b);
+  }
+  // replaced components are subtracted, remove the rounding residuals
+  for (auto& m : _means) if (m < 0) m = 0;
+  _means_support = _model_support.rebinned(_ngroup);
+  _means_stale = false;
+
+  // the tables survive a model that was rebuilt with the same expectations
+  if (_means != _prev_means) _tables.clear();
+}
+
+GerdaFastFactory::snapshot GerdaFastFactory::GetSnapshot() {
+
+  if (_empty) throw std::runtime_error("GerdaFastFactory::GetSnapshot] must call GerdaFastFactory::AddComponent first.");
+  this->UpdateMeans();
+  return snapshot{_means, _means_support};
+}
+
+void GerdaFastFactory::Restore(const snapshot& snap) {
+
+  if (snap.means.empty()) throw std::runtime_error("GerdaFastFactory::Restore] empty snapshot.");
+  if (snap.support.nbins != static_cast<int>(snap.means.size())) {
+    throw std::runtime_error("GerdaFastFactory::Restore] snapshot support does not match its number of bins.");
+  }
+
+  this->Reset();
+  _prev_means.swap(_means);
+  _means = snap.means;
+  _means_support = snap.support;
+  _counts.resize(_means.size());
+  _empty = false;
+  _means_stale = false;
+
+  if (_means != _prev_means) _tables.clear();
+}
+
+// the model histogram and the buffers are kept, to be refilled by the next
+// AddComponent() calls
 void GerdaFastFactory::Reset() {
-  _model.release();
+  // exact zeros: scaling by 0 would keep non-finite contents
+  if (_model) {
+    for (auto& r : _model_support.ranges) {
+      for (int b = r.first; b <= r.second; ++b) _model->SetBinContent(b, 0);
+    }
+  }
+  _model_support = sparse::support();
+  _components.clear();
+  _replaced.clear();
+  _empty = true;
+  _means_stale = true;
 }
@@ -27,7 +27,10 @@
 #include <memory>
 
 #include "TH1.h"
-#include "TRandom3.h"
+
+#include "GerdaSampling.h"
+#include "GerdaRandom.h"
+#include "GerdaSupport.h"
 
 class GerdaFastFactory {
 
@@ -43,17 +46,117 @@ class GerdaFastFactory {
 
     inline TH1* GetModel() const { return _model.get(); }
 
+    // random numbers of experiment i depend only on (seed, i)
+    inline void SetSeed(ULong64_t seed) { _rndgen.SetSeed(seed); }
+    inline ULong64_t GetSeed() const { return _rndgen.GetGlobalSeed(); }
+    inline void SetExperimentIndex(UInt_t i) { _rndgen.SetStream(i, GerdaRandom::toy); }
+
+    // experiments are generated with ngroup adjacent model bins merged,
+    // i.e. from the rebinned model (a sum of Poisson numbers is Poisson)
+    void SetRebinFactor(int ngroup);
+    inline int GetRebinFactor() const { return _ngroup; }
+
     void SetCountsRange(float xmin, float xmax);
     void AddComponent(const TH1* hist, const float counts);
+    // supp must contain all the non-empty bins of hist, only those are read
+    void AddComponent(const TH1* hist, const float counts, const sparse::support& supp);
     void AddComponent(const std::unique_ptr<TH1>& hist, const float counts);
     std::unique_ptr<TH1> GetPseudoExp();
+    // no heap allocation per experiment: out must have the (rebinned) model
+    // binning, counts must have room for as many integers as its bins
+    void FillPseudoExp(TH1& out);
+    void FillPseudoExp(int* counts);
+    // n experiments as rows of a row-major n x nbins matrix of bin counts
+    // (nbins after rebinning),
+    // generated bin by bin. The caller-owned version expects room for n*nbins
+    // integers
+    std::vector<int> GenerateBatch(int n);
+    void GenerateBatch(int n, int* counts);
+    // draw single experiments from per-bin Poisson tables, built once per
+    // model (see sampling::poisson_tables). They are kept as long as the
+    // expectations do not change, also across Reset() if the model is rebuilt
+    // identical, so this pays off for fixed models only. Changes the random
+    // sequence, not the distribution. GenerateBatch() is not affected
+    inline void SetPoissonTables(bool on) { _use_tables = on; }
+    inline bool GetPoissonTables() const { return _use_tables; }
     void Reset();
 
+    // incremental assembly, for models that differ from a base model in a
+    // few components only. SetBase() stores the components added so far as
+    // base model, together with their normalizations, ResetToBase() starts
+    // a new model from it (instead of Reset()) and ReplaceComponent() swaps
+    // the shape of the i-th base component (in order of addition) with a new
+    // one, at most once per ResetToBase(). The cost is then proportional to
+    // the number of replaced components. The counts range must not change
+    // after SetBase(). The base shapes are not copied and must outlive the
+    // factory (or the next SetBase()), new_hist is only read during the call
+    void SetBase();
+    void ResetToBase();
+    void ReplaceComponent(size_t i, const TH1* new_hist, const float counts, const sparse::support& supp);
+
+    // integral of hist in the counts range, components are added as
+    // counts*hist/GetNormalization(hist)
+    double GetNormalization(const TH1& hist, const sparse::support& supp) const;
+    // direct updates of the model on supp, for callers that know how the
+    // contribution of a component changes (see distortions::plan). Nothing
+    // is normalized: model += a*x + b*y and model += x*(a*y + b) resp. The
+    // model support is extended to supp
+    void AddToModel(const TH1& x, double a, const TH1& y, double b, const sparse::support& supp);
+    void AddProductToModel(const TH1& x, const TH1& y, double a, double b, const sparse::support& supp);
+
+    // the (rebinned) expectations of a model, all that is needed to generate
+    // experiments from it
+    struct snapshot {
+        std::vector<double> means;
+        sparse::support support;
+
+        inline size_t bytes() const {
+            return sizeof(snapshot) + means.capacity()*sizeof(double)
+                + support.ranges.capacity()*sizeof(std::pair<int,int>);
+        }
+    };
+    snapshot GetSnapshot();
+    // replaces the model with a snapshot taken before. The model histogram
+    // (GetModel()) is left empty, as after Reset()
+    void Restore(const snapshot& snap);
+
     private:
 
-    TRandom3 _rndgen;
+    GerdaRandom _rndgen;
     std::unique_ptr<TH1> _model;
+    // union of the supports of the added components
+    sparse::support _model_support;
     std::pair<float, float> _range;
+    // no components added since construction or last Reset()
+    bool _empty;
+
+    // added components as (shape, counts/normalization), in order. Shapes
+    // are not owned, see SetBase()
+    std::vector<std::pair<const TH1*, double>> _components;
+
+    // base model for the incremental assembly, see SetBase()
+    std::unique_ptr<TH1> _base;
+    sparse::support _base_support;
+    std::vector<std::pair<const TH1*, double>> _base_components;
+    std::vector<bool> _replaced;
+
+    int _ngroup;
+
+    // per-bin expectations (at the output binning) and counts buffers for the
+    // batch Poisson generator, _means is refreshed from _model when stale
+    std::vector<double> _means;
+    sparse::support _means_support;
+    std::vector<int> _counts;
+    bool _means_stale;
+    // means of the previous model, to detect whether it actually changed
+    std::vector<double> _prev_means;
+
+    // Poisson tables for _means, built on first use
+    bool _use_tables;
+    sampling::poisson_tables _tables;
+
+    void UpdateMeans();
+    void DrawCounts(int* counts);
 };
 
 #endif
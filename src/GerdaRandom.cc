@@ -0,0 +1,123 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "GerdaRandom.h"
+
+#include <random>
+
+namespace {
+
+    inline void mulhilo(uint32_t a, uint32_t b, uint32_t& hi, uint32_t& lo) {
+        uint64_t p = static_cast<uint64_t>(a) * b;
+        hi = p >> 32;
+        lo = static_cast<uint32_t>(p);
+    }
+
+    void philox4x32_10(const uint32_t ctr[4], const uint32_t key[2], uint32_t out[4]) {
+        const uint32_t m0 = 0xD2511F53, m1 = 0xCD9E8D57;
+        const uint32_t w0 = 0x9E3779B9, w1 = 0xBB67AE85;
+
+        uint32_t c[4] = {ctr[0], ctr[1], ctr[2], ctr[3]};
+        uint32_t k[2] = {key[0], key[1]};
+
+        for (int r = 0; r < 10; ++r) {
+            if (r > 0) { k[0] += w0; k[1] += w1; }
+            uint32_t hi0, lo0, hi1, lo1;
+            mulhilo(m0, c[0], hi0, lo0);
+            mulhilo(m1, c[2], hi1, lo1);
+            c[0] = hi1 ^ c[1] ^ k[0];
+            c[1] = lo1;
+            c[2] = hi0 ^ c[3] ^ k[1];
+            c[3] = lo0;
+        }
+        for (int i = 0; i < 4; ++i) out[i] = c[i];
+    }
+}
+
+GerdaRandom::GerdaRandom() :
+    GerdaRandom(GerdaRandom::RandomSeed()) {}
+
+GerdaRandom::GerdaRandom(ULong64_t seed) :
+    TRandom(0),
+    _key(seed),
+    _experiment(0),
+    _purpose(toy),
+    _counter(0),
+    _pos(4) {
+
+    SetName("GerdaRandom");
+    SetTitle("Philox4x32-10 counter-based generator");
+}
+
+void GerdaRandom::SetSeed(ULong_t seed) {
+    _key = seed;
+    _counter = 0;
+    _pos = 4;
+}
+
+void GerdaRandom::SetStream(UInt_t experiment, purpose p) {
+    _experiment = experiment;
+    _purpose = p;
+    _counter = 0;
+    _pos = 4;
+}
+
+void GerdaRandom::NextBlock() {
+    const uint32_t ctr[4] = {
+        static_cast<uint32_t>(_counter),
+        static_cast<uint32_t>(_counter >> 32),
+        _experiment,
+        _purpose
+    };
+    const uint32_t key[2] = {
+        static_cast<uint32_t>(_key),
+        static_cast<uint32_t>(_key >> 32)
+    };
+    philox4x32_10(ctr, key, _block);
+    ++_counter;
+    _pos = 0;
+}
+
+// uniform in (0, 1), with 53 random bits
+Double_t GerdaRandom::Rndm() {
+    if (_pos >= 4) this->NextBlock();
+    uint64_t x = (static_cast<uint64_t>(_block[_pos]) << 32) | _block[_pos+1];
+    _pos += 2;
+    return ((x >> 11) + 0.5) * (1./9007199254740992.);
+}
+
+void GerdaRandom::RndmArray(Int_t n, Float_t* array) {
+    for (int i = 0; i < n; ++i) {
+        // rounding to float could give exactly 1
+        do { array[i] = this->Rndm(); } while (array[i] >= 1);
+    }
+}
+
+void GerdaRandom::RndmArray(Int_t n, Double_t* array) {
+    for (int i = 0; i < n; ++i) array[i] = this->Rndm();
+}
+
+ULong64_t GerdaRandom::RandomSeed() {
+    std::random_device rd;
+    return (static_cast<ULong64_t>(rd()) << 32) | rd();
+}
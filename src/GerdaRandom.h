@@ -0,0 +1,80 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef _GERDA_RANDOM_H
+#define _GERDA_RANDOM_H
+
+#include <cstdint>
+
+#include "TRandom.h"
+
+// Counter-based (Philox4x32-10) random number generator, see J. K. Salmon et
+// al., SC'11 (2011) 16. The n-th number of a stream is a pure function of
+// (seed, experiment, purpose, n), so every experiment can be regenerated on
+// its own and runs split among workers reproduce the serial ones bit by bit
+class GerdaRandom : public TRandom {
+
+    public:
+
+    // what the random numbers of a stream are used for
+    enum purpose {
+        toy = 0,           // Poisson fluctuations and event sampling
+        distortion = 1,    // choice of the PDF distortions
+        stratification = 2 // assignment of experiments to distortion combinations
+    };
+
+    // seeded from std::random_device
+    GerdaRandom();
+    explicit GerdaRandom(ULong64_t seed);
+    ~GerdaRandom() = default;
+
+    // sets the global seed and rewinds to the beginning of the current stream
+    void SetSeed(ULong_t seed = 0) override;
+    inline ULong64_t GetGlobalSeed() const { return _key; }
+
+    // jumps to the beginning of the stream for the given experiment and purpose
+    void SetStream(UInt_t experiment, purpose p);
+
+    using TRandom::Rndm;
+    Double_t Rndm() override;
+    void RndmArray(Int_t n, Float_t* array) override;
+    void RndmArray(Int_t n, Double_t* array) override;
+
+    // a fresh non-deterministic seed, to be logged so that the run can be
+    // reproduced later
+    static ULong64_t RandomSeed();
+
+    private:
+
+    void NextBlock();
+
+    ULong64_t _key;
+    UInt_t _experiment;
+    UInt_t _purpose;
+    ULong64_t _counter;
+    // last Philox output block, consumed as two 64 bit words
+    uint32_t _block[4];
+    int _pos;
+};
+
+#endif
@@ -0,0 +1,403 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "GerdaSampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+namespace sampling {
+
+    namespace {
+
+        // Vose's variant of the Walker alias method, see M. D. Vose, IEEE
+        // Trans. Softw. Eng. 17 (1991) 972. p holds the n probabilities scaled
+        // such that their average is 1 and is overwritten
+        void vose(double* p, int n, double* prob, int* alias) {
+            std::vector<int> small, large;
+            small.reserve(n);
+            large.reserve(n);
+            for (int i = 0; i < n; ++i) {
+                if (p[i] < 1) small.push_back(i);
+                else large.push_back(i);
+            }
+
+            while (!small.empty() and !large.empty()) {
+                auto s = small.back(); small.pop_back();
+                auto l = large.back(); large.pop_back();
+
+                prob[s] = p[s];
+                alias[s] = l;
+
+                p[l] = (p[l] + p[s]) - 1;
+                if (p[l] < 1) small.push_back(l);
+                else large.push_back(l);
+            }
+
+            // whatever is left has probability one, up to rounding errors
+            for (auto i : large) { prob[i] = 1; alias[i] = i; }
+            for (auto i : small) { prob[i] = 1; alias[i] = i; }
+        }
+    }
+
+    // negative bin contents are treated as zero
+    void alias_table::build(const TH1& hist) {
+        const int n = hist.GetNbinsX();
+
+        prob.clear();
+        alias.clear();
+
+        double sum = 0;
+        for (int b = 1; b <= n; ++b) sum += std::max(hist.GetBinContent(b), 0.);
+        if (!(sum > 0)) return;
+
+        prob.resize(n);
+        alias.resize(n);
+
+        std::vector<double> p(n);
+        for (int i = 0; i < n; ++i) p[i] = std::max(hist.GetBinContent(i+1), 0.) * n / sum;
+
+        vose(p.data(), n, prob.data(), alias.data());
+    }
+
+    int alias_table::sample(TRandom& rndgen) const {
+        const int n = prob.size();
+
+        // split a single uniform number into column index and coin flip
+        double u = rndgen.Rndm() * n;
+        int i = static_cast<int>(u);
+        if (i >= n) i = n-1;
+        u -= i;
+
+        return (u < prob[i] ? i : alias[i]) + 1;
+    }
+
+    namespace {
+
+        // log(k!) - [(k+1/2)log(k+1) - (k+1) + log(2pi)/2], Stirling correction
+        double stirling_corr(int k) {
+            static const double table[] = {
+                0.08106146679532726, 0.04134069595540929, 0.02767792568499834,
+                0.02079067210376509, 0.01664469118982119, 0.01387612882307075,
+                0.01189670994589177, 0.01041126526197209, 0.00925546218271273,
+                0.00833056343336287
+            };
+            if (k < 10) return table[k];
+            double r = 1./(k+1);
+            double rsq = r*r;
+            return (1./12 - (1./360 - rsq/1260)*rsq)*r;
+        }
+
+        // sequential inversion, for small n*p
+        int binomial_inv(TRandom& rndgen, int n, double p) {
+            const double q = 1 - p;
+            const double s = p/q;
+            const double a = (n+1)*s;
+            const double r0 = std::pow(q, n);
+            while (true) {
+                double r = r0;
+                double u = rndgen.Rndm();
+                int x = 0;
+                while (u > r) {
+                    u -= r;
+                    if (++x > n) break;
+                    r *= a/x - s;
+                }
+                if (x <= n) return x;
+            }
+        }
+
+        // BTRD transformed rejection, see W. Hörmann, J. Statist. Comput.
+        // Simul. 46 (1993) 101. Valid for n*p >= 10 and p <= 1/2
+        int binomial_btrd(TRandom& rndgen, int n, double p) {
+            const double q = 1 - p;
+            const int m = std::floor((n+1)*p);
+            const double r = p/q;
+            const double nr = (n+1)*r;
+            const double npq = n*p*q;
+            const double sqrt_npq = std::sqrt(npq);
+            const double b = 1.15 + 2.53*sqrt_npq;
+            const double a = -0.0873 + 0.0248*b + 0.01*p;
+            const double c = n*p + 0.5;
+            const double alpha = (2.83 + 5.1/b)*sqrt_npq;
+            const double v_r = 0.92 - 4.2/b;
+            const double u_rv_r = 0.86*v_r;
+
+            while (true) {
+                double u, v = rndgen.Rndm();
+                if (v <= u_rv_r) {
+                    u = v/v_r - 0.43;
+                    return std::floor((2*a/(0.5 - std::abs(u)) + b)*u + c);
+                }
+                if (v >= v_r) {
+                    u = rndgen.Rndm() - 0.5;
+                }
+                else {
+                    u = v/v_r - 0.93;
+                    u = (u < 0 ? -0.5 : 0.5) - u;
+                    v = rndgen.Rndm()*v_r;
+                }
+
+                const double us = 0.5 - std::abs(u);
+                const int k = std::floor((2*a/us + b)*u + c);
+                if (k < 0 or k > n) continue;
+
+                v = v*alpha/(a/(us*us) + b);
+                const int km = std::abs(k - m);
+
+                // recursive evaluation of f(k)/f(m)
+                if (km <= 15) {
+                    double f = 1;
+                    if (m < k) for (int i = m+1; i <= k; ++i) f *= nr/i - r;
+                    else if (m > k) for (int i = k+1; i <= m; ++i) v *= nr/i - r;
+                    if (v <= f) return k;
+                    continue;
+                }
+
+                // squeeze, then full acceptance test
+                v = std::log(v);
+                const double rho = (km/npq)*(((km/3. + 0.625)*km + 1./6)/npq + 0.5);
+                const double t = -km*double(km)/(2*npq);
+                if (v < t - rho) return k;
+                if (v > t + rho) continue;
+
+                const double nm = n - m + 1;
+                const double h = (m + 0.5)*std::log((m + 1)/(r*nm)) + stirling_corr(m) + stirling_corr(n - m);
+                const double nk = n - k + 1;
+                if (v <= h + (n + 1)*std::log(nm/nk) + (k + 0.5)*std::log(nk*r/(k + 1))
+                          - stirling_corr(k) - stirling_corr(n - k)) return k;
+            }
+        }
+    }
+
+    int binomial(TRandom& rndgen, int n, double p) {
+        if (n <= 0 or p <= 0) return 0;
+        if (p >= 1) return n;
+        if (p > 0.5) return n - binomial(rndgen, n, 1 - p);
+        return n*p < 10 ? binomial_inv(rndgen, n, p) : binomial_btrd(rndgen, n, p);
+    }
+
+    namespace {
+
+        // PTRS transformed rejection, see W. Hörmann, Insurance Math. Econom.
+        // 12 (1993) 39. Valid for mean >= 10. The setup only depends on the
+        // mean and is done once per instance
+        struct poisson_ptrs {
+            double mean, loglam, a, b, log_invalpha, vr;
+
+            explicit poisson_ptrs(double m) :
+                mean(m),
+                loglam(std::log(m)),
+                b(0.931 + 2.53*std::sqrt(m)) {
+                a = -0.059 + 0.02483*b;
+                log_invalpha = std::log(1.1239 + 1.1328/(b - 3.4));
+                vr = 0.9277 - 3.6224/(b - 2);
+            }
+
+            int operator()(TRandom& rndgen) const {
+                while (true) {
+                    const double u = rndgen.Rndm() - 0.5;
+                    const double v = rndgen.Rndm();
+                    const double us = 0.5 - std::abs(u);
+                    const double k = std::floor((2*a/us + b)*u + mean + 0.43);
+                    if (us >= 0.07 and v <= vr) return k;
+                    if (k < 0 or (us < 0.013 and v > us)) continue;
+                    if (std::log(v) + log_invalpha - std::log(a/(us*us) + b) <=
+                        -mean + k*loglam - std::lgamma(k + 1)) return k;
+                }
+            }
+        };
+
+        const double ptrs_min_mean = 10;
+        const int block_size = 64;
+        // P(k >= 64) is below 1e-25 for means < 10, the cap only protects
+        // against u == 1 never being reached by the rounded cumulative
+        const int max_inversion_steps = 64;
+
+        // inversion of the cumulative on a block of lanes at once. All lanes
+        // step together and are masked out when done, so that the inner
+        // loops have no branches and can be auto-vectorized
+        void poisson_inv_block(const double* mean, const double* u, int* counts, int n) {
+            double p[block_size], cdf[block_size], k[block_size];
+
+            for (int l = 0; l < n; ++l) {
+                p[l] = std::exp(-mean[l]);
+                cdf[l] = p[l];
+                k[l] = 0;
+            }
+
+            auto any_active = [&]() {
+                for (int l = 0; l < n; ++l) if (u[l] > cdf[l]) return true;
+                return false;
+            };
+
+            for (int step = 0; step < max_inversion_steps and any_active(); ++step) {
+                for (int l = 0; l < n; ++l) {
+                    // a is 1 for lanes still moving, 0 otherwise
+                    const double a = u[l] > cdf[l] ? 1. : 0.;
+                    k[l] += a;
+                    p[l] *= 1 + a*(mean[l]/(k[l] + 1 - a) - 1);
+                    cdf[l] += a*p[l];
+                }
+            }
+
+            for (int l = 0; l < n; ++l) counts[l] = k[l];
+        }
+    }
+
+    void poisson(TRandom& rndgen, const double* means, int* counts, int n) {
+
+        // lanes gathered from the small-mean entries
+        double block_mean[block_size], block_u[block_size];
+        int block_idx[block_size], block_counts[block_size];
+        int nblock = 0;
+
+        auto flush = [&]() {
+            rndgen.RndmArray(nblock, block_u);
+            poisson_inv_block(block_mean, block_u, block_counts, nblock);
+            for (int l = 0; l < nblock; ++l) counts[block_idx[l]] = block_counts[l];
+            nblock = 0;
+        };
+
+        for (int i = 0; i < n; ++i) {
+            if (!(means[i] > 0)) {
+                counts[i] = 0;
+            }
+            else if (means[i] < ptrs_min_mean) {
+                block_mean[nblock] = means[i];
+                block_idx[nblock] = i;
+                if (++nblock == block_size) flush();
+            }
+            else counts[i] = poisson_ptrs(means[i])(rndgen);
+        }
+        if (nblock > 0) flush();
+    }
+
+    void poisson(TRandom& rndgen, double mean, int* counts, int n, int stride) {
+
+        // n*stride can exceed the int range for large toy batches
+        const std::ptrdiff_t step = stride;
+
+        if (!(mean > 0)) {
+            for (int i = 0; i < n; ++i) counts[i*step] = 0;
+        }
+        else if (mean < ptrs_min_mean) {
+            // the cumulative is computed once and searched for each draw
+            double cdf[max_inversion_steps];
+            double p = std::exp(-mean);
+            cdf[0] = p;
+            int kmax = 0;
+            while (kmax < max_inversion_steps-1 and cdf[kmax] < 1) {
+                ++kmax;
+                p *= mean/kmax;
+                cdf[kmax] = cdf[kmax-1] + p;
+            }
+
+            double u[block_size];
+            for (int i = 0; i < n; i += block_size) {
+                const int nblock = std::min(block_size, n - i);
+                rndgen.RndmArray(nblock, u);
+                for (int l = 0; l < nblock; ++l) {
+                    int k = 0;
+                    while (k < kmax and u[l] > cdf[k]) ++k;
+                    counts[(i+l)*step] = k;
+                }
+            }
+        }
+        else {
+            const poisson_ptrs gen(mean);
+            for (int i = 0; i < n; ++i) counts[i*step] = gen(rndgen);
+        }
+    }
+
+    constexpr double poisson_tables::max_mean;
+
+    void poisson_tables::clear() {
+        index.clear(); offset.clear(); size.clear();
+        prob.clear(); alias.clear();
+        generic.clear(); generic_means.clear();
+        n = 0;
+    }
+
+    void poisson_tables::build(const double* means, int nentries) {
+        this->clear();
+        n = nentries;
+
+        std::vector<double> pmf;
+        for (int i = 0; i < n; ++i) {
+            const double mean = means[i];
+            if (!(mean > 0)) continue;
+            if (mean > max_mean) {
+                generic.push_back(i);
+                generic_means.push_back(mean);
+                continue;
+            }
+
+            // past the mode the tail sum is bounded by pmf(k)/(1 - mean/(k+1)),
+            // stop when that is negligible with respect to the total
+            pmf.clear();
+            double p = std::exp(-mean), sum = 0;
+            for (int k = 0; ; ++k) {
+                pmf.push_back(p);
+                sum += p;
+                if (k+1 > mean and p < 1e-16*sum*(1 - mean/(k+1))) break;
+                p *= mean/(k+1);
+            }
+
+            const int ncol = pmf.size();
+            for (auto& x : pmf) x *= ncol/sum;
+
+            index.push_back(i);
+            offset.push_back(prob.size());
+            size.push_back(ncol);
+            prob.resize(prob.size() + ncol);
+            alias.resize(alias.size() + ncol);
+            vose(pmf.data(), ncol, &prob[offset.back()], &alias[offset.back()]);
+        }
+    }
+
+    void poisson_tables::draw(TRandom& rndgen, int* counts) const {
+        std::fill(counts, counts + n, 0);
+
+        double u[block_size];
+        const int ntab = index.size();
+        for (int j = 0; j < ntab; j += block_size) {
+            const int nblock = std::min(block_size, ntab - j);
+            rndgen.RndmArray(nblock, u);
+            for (int l = 0; l < nblock; ++l) {
+                // split the uniform number into column index and coin flip
+                const int t = j + l;
+                double x = u[l] * size[t];
+                int c = static_cast<int>(x);
+                if (c >= size[t]) c = size[t]-1;
+                x -= c;
+                const int o = offset[t];
+                counts[index[t]] = x < prob[o+c] ? c : alias[o+c];
+            }
+        }
+
+        for (size_t j = 0; j < generic.size(); ++j) {
+            poisson(rndgen, generic_means[j], &counts[generic[j]], 1);
+        }
+    }
+}
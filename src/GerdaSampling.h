@@ -0,0 +1,94 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _GERDA_SAMPLING_H
+#define _GERDA_SAMPLING_H
+
+#include <vector>
+
+#include "TH1.h"
+#include "TRandom.h"
+
+namespace sampling {
+
+    // Walker/Vose alias table over the (in-range) bins of a TH1. Building it
+    // costs O(nbins), drawing a bin index afterwards is O(1) and needs a
+    // single uniform random number
+    struct alias_table {
+        std::vector<double> prob;
+        std::vector<int> alias;
+
+        alias_table() = default;
+        explicit alias_table(const TH1& hist) { this->build(hist); }
+
+        void build(const TH1& hist);
+        inline bool empty() const { return prob.empty(); }
+        // returns a bin index in [1, nbins]
+        int sample(TRandom& rndgen) const;
+    };
+
+    // binomial random numbers in O(1) expected time, also for large n.
+    // TRandom::Binomial() loops over the n trials
+    int binomial(TRandom& rndgen, int n, double p);
+
+    // fills counts[i] with a Poisson random number of mean means[i], for i in
+    // [0, n). Means below 10 are processed in blocks by vectorizable
+    // inversion, larger ones by PTRS transformed rejection. Means <= 0 give
+    // zero counts without consuming random numbers
+    void poisson(TRandom& rndgen, const double* means, int* counts, int n);
+
+    // n Poisson random numbers with the same mean, written to counts[0],
+    // counts[stride], ..., counts[(n-1)*stride]. The per-mean setup is done
+    // once for all the draws
+    void poisson(TRandom& rndgen, double mean, int* counts, int n, int stride = 1);
+
+    // Poisson distributions for a fixed array of means, tabulated once as
+    // alias tables over k (truncated where the remaining tail mass is below
+    // double precision). Drawing the whole array afterwards costs a single
+    // uniform random number and a lookup per entry, which pays off when many
+    // arrays are drawn from the same means. Entries with a mean above
+    // max_mean are not tabulated and fall back to poisson()
+    struct poisson_tables {
+        static constexpr double max_mean = 64;
+
+        // per tabulated entry: its index, first column in prob/alias and
+        // number of columns
+        std::vector<int> index, offset, size;
+        std::vector<double> prob;
+        std::vector<int> alias;
+        // entries left to the generic generator and their means
+        std::vector<int> generic;
+        std::vector<double> generic_means;
+        int n = 0;
+
+        poisson_tables() = default;
+        poisson_tables(const double* means, int n) { this->build(means, n); }
+
+        void build(const double* means, int n);
+        void clear();
+        inline bool empty() const { return n == 0; }
+        // fills counts[0, n), same conventions as poisson()
+        void draw(TRandom& rndgen, int* counts) const;
+    };
+}
+
+#endif
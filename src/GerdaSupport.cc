@@ -0,0 +1,298 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include "GerdaSupport.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+
+namespace sparse {
+
+    namespace {
+
+        // gaps shorter than this are cheaper to walk through than to skip
+        const int min_gap = 8;
+        // above this fraction of covered bins dense storage is used
+        const double max_sparse_fraction = 0.75;
+
+        // merges close ranges and switches to dense if convenient. Ranges
+        // must be sorted by first bin
+        void normalize(support& supp) {
+            std::vector<std::pair<int, int>> out;
+            for (auto& r : supp.ranges) {
+                if (!out.empty() and r.first - out.back().second <= min_gap) {
+                    out.back().second = std::max(out.back().second, r.second);
+                }
+                else out.push_back(r);
+            }
+            supp.ranges.swap(out);
+
+            if (supp.covered() >= max_sparse_fraction*supp.nbins) {
+                supp.ranges.assign(1, std::make_pair(1, supp.nbins));
+            }
+        }
+
+        // true if all the bins of other are in supp, both sorted and disjoint
+        bool covers(const support& supp, const support& other) {
+            auto r = supp.ranges.begin();
+            for (auto& o : other.ranges) {
+                while (r != supp.ranges.end() and r->second < o.first) ++r;
+                if (r == supp.ranges.end() or r->first > o.first or r->second < o.second) return false;
+            }
+            return true;
+        }
+
+        template <class Content>
+        support scan(int nbins, Content content) {
+            support supp;
+            supp.nbins = nbins;
+            int start = 0;
+            for (int b = 1; b <= nbins; ++b) {
+                if (content(b) != 0) {
+                    if (start == 0) start = b;
+                }
+                else if (start != 0) {
+                    supp.ranges.emplace_back(start, b-1);
+                    start = 0;
+                }
+            }
+            if (start != 0) supp.ranges.emplace_back(start, nbins);
+            normalize(supp);
+            return supp;
+        }
+
+        // the kernels index all the histograms with the bins in supp
+        void check_binning(const char* where, const TH1& hist, const TH1& other, const support& supp) {
+            if (other.GetNbinsX() != hist.GetNbinsX() or (!supp.empty() and supp.nbins != hist.GetNbinsX())) {
+                throw std::runtime_error(std::string("sparse::") + where + "] histograms with different number of bins.");
+            }
+        }
+
+        // bin contents as a plain array indexed by bin, for TH1Ds only
+        double* raw(TH1& hist) {
+            auto h = dynamic_cast<TH1D*>(&hist);
+            return h ? h->GetArray() : nullptr;
+        }
+        const double* raw(const TH1& hist) {
+            auto h = dynamic_cast<const TH1D*>(&hist);
+            return h ? h->GetArray() : nullptr;
+        }
+    }
+
+    support support::full(int nbins) {
+        support supp;
+        supp.nbins = nbins;
+        if (nbins > 0) supp.ranges.emplace_back(1, nbins);
+        return supp;
+    }
+
+    int support::covered() const {
+        int n = 0;
+        for (auto& r : ranges) n += r.second - r.first + 1;
+        return n;
+    }
+
+    void support::merge(const support& other) {
+        if (other.empty()) return;
+        if (this->empty()) { *this = other; return; }
+        if (nbins != other.nbins) throw std::runtime_error("sparse::support::merge] supports with different number of bins.");
+        if (this->dense()) return;
+        if (other.dense()) { *this = other; return; }
+        // the common case of model updates, without allocations
+        if (covers(*this, other)) return;
+
+        std::vector<std::pair<int, int>> all;
+        all.reserve(ranges.size() + other.ranges.size());
+        std::merge(ranges.begin(), ranges.end(), other.ranges.begin(), other.ranges.end(), std::back_inserter(all));
+        ranges.swap(all);
+        normalize(*this);
+    }
+
+    support support::rebinned(int ngroup) const {
+        support supp;
+        supp.nbins = nbins/ngroup;
+        for (auto& r : ranges) {
+            auto first = (r.first - 1)/ngroup + 1;
+            auto last = std::min((r.second - 1)/ngroup + 1, supp.nbins);
+            if (first > last) continue;
+            if (!supp.ranges.empty() and first <= supp.ranges.back().second + 1) {
+                supp.ranges.back().second = std::max(supp.ranges.back().second, last);
+            }
+            else supp.ranges.emplace_back(first, last);
+        }
+        normalize(supp);
+        return supp;
+    }
+
+    support index(const TH1& hist) {
+        return scan(hist.GetNbinsX(), [&hist](int b) { return hist.GetBinContent(b); });
+    }
+
+    support clip_and_index(TH1& hist, std::vector<int>& clipped) {
+        const int nbins = hist.GetNbinsX();
+        for (int b : {0, nbins+1}) {
+            if (hist.GetBinContent(b) < 0) {
+                hist.SetBinContent(b, 0);
+                clipped.push_back(b);
+            }
+        }
+        return scan(nbins, [&hist, &clipped](int b) {
+            auto c = hist.GetBinContent(b);
+            if (c < 0) {
+                hist.SetBinContent(b, 0);
+                clipped.push_back(b);
+                return 0.;
+            }
+            return c;
+        });
+    }
+
+    double integral(const TH1& hist, const support& supp, int first, int last) {
+        if (last < 0) last = supp.nbins;
+        double sum = 0;
+        for (auto& r : supp.ranges) {
+            for (int b = std::max(r.first, first); b <= std::min(r.second, last); ++b) {
+                sum += hist.GetBinContent(b);
+            }
+        }
+        return sum;
+    }
+
+    void scale(TH1& hist, double c, const support& supp) {
+        for (auto& r : supp.ranges) {
+            for (int b = r.first; b <= r.second; ++b) hist.SetBinContent(b, c*hist.GetBinContent(b));
+        }
+    }
+
+    void multiply(TH1& hist, const TH1& other, const support& supp) {
+        check_binning("multiply", hist, other, supp);
+        for (auto& r : supp.ranges) {
+            for (int b = r.first; b <= r.second; ++b) {
+                hist.SetBinContent(b, hist.GetBinContent(b)*other.GetBinContent(b));
+            }
+        }
+    }
+
+    void add(TH1& hist, const TH1& other, double c, const support& supp) {
+        check_binning("add", hist, other, supp);
+        for (auto& r : supp.ranges) {
+            for (int b = r.first; b <= r.second; ++b) {
+                hist.SetBinContent(b, hist.GetBinContent(b) + c*other.GetBinContent(b));
+            }
+        }
+    }
+
+    bool constant(const TH1& hist, const support& supp, double& c, double rel_tol) {
+        if (supp.empty()) return false;
+        c = hist.GetBinContent(supp.ranges.front().first);
+        const double tol = rel_tol*std::abs(c);
+        for (auto& r : supp.ranges) {
+            for (int b = r.first; b <= r.second; ++b) {
+                if (!(std::abs(hist.GetBinContent(b) - c) <= tol)) return false;
+            }
+        }
+        return true;
+    }
+
+    void add(TH1& hist, const TH1& x, double a, const TH1& y, double b, const support& supp) {
+        check_binning("add", hist, x, supp);
+        check_binning("add", hist, y, supp);
+        auto h = raw(hist);
+        auto px = raw(x);
+        auto py = raw(y);
+        if (h and px and py) {
+            for (auto& r : supp.ranges) {
+                for (int i = r.first; i <= r.second; ++i) h[i] += a*px[i] + b*py[i];
+            }
+            return;
+        }
+        for (auto& r : supp.ranges) {
+            for (int i = r.first; i <= r.second; ++i) {
+                hist.SetBinContent(i, hist.GetBinContent(i) + a*x.GetBinContent(i) + b*y.GetBinContent(i));
+            }
+        }
+    }
+
+    void add_product(TH1& hist, const TH1& x, const TH1& y, double a, double b, const support& supp) {
+        check_binning("add_product", hist, x, supp);
+        check_binning("add_product", hist, y, supp);
+        auto h = raw(hist);
+        auto px = raw(x);
+        auto py = raw(y);
+        if (h and px and py) {
+            for (auto& r : supp.ranges) {
+                for (int i = r.first; i <= r.second; ++i) h[i] += px[i]*(a*py[i] + b);
+            }
+            return;
+        }
+        for (auto& r : supp.ranges) {
+            for (int i = r.first; i <= r.second; ++i) {
+                hist.SetBinContent(i, hist.GetBinContent(i) + x.GetBinContent(i)*(a*y.GetBinContent(i) + b));
+            }
+        }
+    }
+
+    void interpolate(TH1& hist, const TH1& dist, double w, const support& supp) {
+        check_binning("interpolate", hist, dist, supp);
+        auto h = raw(hist);
+        auto d = raw(dist);
+
+        // integrals of hist and of hist*dist
+        double s0 = 0, s1 = 0;
+        if (h and d) {
+            for (auto& r : supp.ranges) {
+                for (int i = r.first; i <= r.second; ++i) {
+                    s0 += h[i];
+                    s1 += h[i]*d[i];
+                }
+            }
+        }
+        else {
+            for (auto& r : supp.ranges) {
+                for (int i = r.first; i <= r.second; ++i) {
+                    auto c = hist.GetBinContent(i);
+                    s0 += c;
+                    s1 += c*dist.GetBinContent(i);
+                }
+            }
+        }
+
+        // (1-w)/s0 * hist + w/s1 * hist*dist
+        const double a = (1-w)/s0;
+        const double b = w/s1;
+        if (h and d) {
+            for (auto& r : supp.ranges) {
+                for (int i = r.first; i <= r.second; ++i) h[i] *= a + b*d[i];
+            }
+        }
+        else {
+            for (auto& r : supp.ranges) {
+                for (int i = r.first; i <= r.second; ++i) {
+                    hist.SetBinContent(i, hist.GetBinContent(i)*(a + b*dist.GetBinContent(i)));
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,90 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef _GERDA_SUPPORT_H
+#define _GERDA_SUPPORT_H
+
+#include <vector>
+#include <utility>
+
+#include "TH1.h"
+
+namespace sparse {
+
+    // Superset of the (in-range) bins of a histogram with non-zero content,
+    // as a sorted list of disjoint [first, last] bin ranges (inclusive, like
+    // TH1::Integral). Short gaps are merged, and when the ranges would cover
+    // most of the axis anyway a single [1, nbins] range is kept instead, as
+    // plain dense loops are then cheaper
+    struct support {
+        std::vector<std::pair<int, int>> ranges;
+        int nbins;
+
+        support() : nbins(0) {}
+        static support full(int nbins);
+
+        inline bool empty() const { return ranges.empty(); }
+        inline bool dense() const { return ranges.size() == 1 and ranges[0].first == 1 and ranges[0].second == nbins; }
+        // number of bins in the ranges
+        int covered() const;
+
+        // union with the support of another histogram with the same binning
+        void merge(const support& other);
+        // support of the histogram rebinned by merging ngroup adjacent bins
+        support rebinned(int ngroup) const;
+    };
+
+    // builds the support of hist with a single scan over its bins
+    support index(const TH1& hist);
+    // as above, but also sets negative bin contents (flow bins included) to
+    // zero and appends their indices to clipped
+    support clip_and_index(TH1& hist, std::vector<int>& clipped);
+
+    // TH1 arithmetic restricted to the bins in supp. Contents outside of it
+    // must be zero in hist (integral, scale, multiply) or in other (add).
+    // Flow bins and bin errors are not touched
+    double integral(const TH1& hist, const support& supp, int first = 1, int last = -1);
+    void scale(TH1& hist, double c, const support& supp);
+    void multiply(TH1& hist, const TH1& other, const support& supp);
+    void add(TH1& hist, const TH1& other, double c, const support& supp);
+
+    // true if the contents of hist in supp are all equal to c, within a
+    // relative tolerance. c is set to the first content
+    bool constant(const TH1& hist, const support& supp, double& c, double rel_tol = 1e-12);
+
+    // fused kernels, with a single write pass over supp. They work on the
+    // bin arrays directly (vectorizable) if the histograms are TH1D. All the
+    // binary kernels throw if the histograms (and supp) do not have the same
+    // number of bins
+
+    // hist += a*x + b*y
+    void add(TH1& hist, const TH1& x, double a, const TH1& y, double b, const support& supp);
+    // hist += x*(a*y + b)
+    void add_product(TH1& hist, const TH1& x, const TH1& y, double a, double b, const support& supp);
+    // hist = (1-w) * hist/|hist| + w * hist*dist/|hist*dist|, i.e. the
+    // shape distorted by w*D + (1-w)*U, normalized to one. The integrals are
+    // accumulated in a first read-only pass, no temporary histogram is needed
+    void interpolate(TH1& hist, const TH1& dist, double w, const support& supp);
+}
+
+#endif
@@ -0,0 +1,547 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <algorithm>
+
+#include "TH1.h"
+
+#include "utils.hpp"
+#include "GerdaFastFactory.h"
+#include "GerdaRandom.h"
+#include "GerdaBank.h"
+
+#ifndef DISTORTIONS_HH
+#define DISTORTIONS_HH
+
+namespace distortions {
+
+    namespace logging = utils::logging;
+
+    // all the distortion histograms listed in the "pdf-distortions" config
+    // block, read from disk once. global[group][choice] holds the
+    // distortions of the chosen gerda-pdfs-like folder (only for components
+    // of the model), specific[component][choice] a single histogram
+    struct bank {
+        std::map<std::string, std::vector<std::vector<utils::bkg_comp>>> global;
+        std::map<std::string, std::vector<std::unique_ptr<TH1>>> specific;
+
+        // number of histograms in memory
+        size_t size() const {
+            size_t n = 0;
+            for (auto& g : global) for (auto& c : g.second) n += c.size();
+            for (auto& s : specific) n += s.second.size();
+            return n;
+        }
+    };
+
+    // distortions of global groups get the id of the model component they apply to
+    bank load_bank(json& config, const std::vector<utils::bkg_comp>& comp_list, const utils::component_index& index) {
+        bank b;
+
+        auto& dconfig = config["pdf-distortions"];
+        auto dist_prefix = dconfig.value("prefix", ".") + "/";
+
+        // the prefix can also be a bank packed by gerda-pack-distortions, with
+        // the same layout as the folder, which is then mapped in memory once
+        std::unique_ptr<GerdaBank> packed;
+        if (GerdaBank::IsBank(dconfig.value("prefix", "."))) {
+            packed.reset(new GerdaBank(dconfig.value("prefix", ".")));
+            logging_out(logging::detail) << "reading distortions from bank " << packed->GetFileName()
+                                          << " (" << packed->GetSize() << " histograms)" << std::endl;
+            dist_prefix = "";
+        }
+
+        auto pdfs = [](json::iterator it) {
+            if (!it.value()["pdfs"].is_array() or it.value()["pdfs"].empty()) {
+                throw std::runtime_error("please specify a non-empty array of 'pdfs' for distortion '" + it.key() + "'");
+            }
+            std::vector<std::string> v;
+            for (auto& p : it.value()["pdfs"]) {
+                if (!p.is_string()) throw std::runtime_error("elements in arrays of distortions must be strings");
+                v.push_back(p.get<std::string>());
+            }
+            return v;
+        };
+
+        if (dconfig["global"].is_object()) {
+            for (auto it = dconfig["global"].begin(); it != dconfig["global"].end(); ++it) {
+                auto& group = b.global[it.key()];
+                for (auto& folder : pdfs(it)) {
+                    logging_out(logging::debug) << "loading global distortion '" << folder << "'" << std::endl;
+                    // discard user files here because by definition global
+                    // distortions apply to components coming from gerda-pdfs
+                    // *only*
+                    auto dist_list = utils::get_components_json(config, dist_prefix + folder, true, packed.get());
+                    group.emplace_back();
+                    for (auto& d : dist_list) {
+                        auto comp = index.find(d.name);
+                        if (comp == index.end()) {
+                            logging_out(logging::warning) << "could not find component '" << d.name
+                                                           << "' to distort with '" << folder << "'" << std::endl;
+                            continue;
+                        }
+                        d.id = comp->second;
+                        group.back().push_back(std::move(d));
+                    }
+                }
+            }
+        }
+
+        if (dconfig["specific"].is_object()) {
+            for (auto it = dconfig["specific"].begin(); it != dconfig["specific"].end(); ++it) {
+                auto comp = index.find(it.key());
+                if (comp == index.end()) {
+                    logging_out(logging::warning) << "could not find component '" << it.key()
+                                                   << "' to distort" << std::endl;
+                    continue;
+                }
+
+                // which hist-name to use?
+                std::string hist_name = it.value().value("hist-name", comp_list[comp->second].orig_name);
+                if (hist_name.empty()) {
+                    throw std::runtime_error("I have no clue which histogram to read for '"
+                            + it.key() + "'specific distortions!");
+                }
+
+                auto& hists = b.specific[it.key()];
+                for (auto& file : pdfs(it)) {
+                    logging_out(logging::debug) << "loading specific distortion '" << file << "'" << std::endl;
+                    hists.push_back(utils::get_component(dist_prefix + file, hist_name, 8000, 0, 8000, packed.get()));
+                }
+            }
+        }
+
+        return b;
+    }
+
+    // the distortion block of the config, validated and resolved against the
+    // bank and the model once, so that experiments never look at the JSON
+
+    // what a distortion does to the shape of a component. Components are
+    // normalized to their counts afterwards, so that a constant (positive)
+    // scale leaves the model unchanged as the identity does
+    enum kind { identity, scale, general };
+
+    // distortion histogram for the model component with id comp
+    struct target {
+        size_t comp;
+        const TH1* hist;
+        kind type;
+
+        // for interpolated distortions: integral of the undistorted shape
+        // and difference of the two (normalized) endpoints of the
+        // interpolation, pdf*D/|pdf*D| - pdf/|pdf|
+        double norm;
+        std::shared_ptr<TH1> delta;
+
+        // contribution of the component to the model: base_coef*pdf, and
+        // coef*pdf*D if this distortion is the only one applied to it
+        // (counts over the integral in the counts range, discrete only)
+        double base_coef;
+        double coef;
+        // for interpolated distortions: integrals of pdf/|pdf| and of delta
+        // in the counts range, the one of pdf' is linear in the weight
+        double range0;
+        double range1;
+    };
+
+    // one distortion group: a global one or a specific one (a single target
+    // per candidate)
+    struct step {
+        std::string name;
+        bool interpolate;
+        // for each candidate distortion its label and targets
+        std::vector<std::string> labels;
+        std::vector<std::vector<target>> candidates;
+
+        // without interpolation the last choice stands for no distortion
+        inline UInt_t n_choices() const { return candidates.size() + (interpolate ? 0 : 1); }
+    };
+
+    struct plan {
+        // global groups first, then specific ones, in config order
+        std::vector<step> steps;
+        // number of (component, distortion) pairs and how many of them are
+        // identities or constant scales
+        size_t n_targets = 0, n_identity = 0, n_scale = 0;
+
+        // distorted models are then fully determined by the choices
+        bool discrete() const {
+            for (auto& s : steps) if (s.interpolate) return false;
+            return true;
+        }
+
+        // all the random numbers of an experiment: for each step the chosen
+        // candidate and, if interpolating, one weight per target
+        void draw(TRandom& rndgen, std::vector<UInt_t>& choices, std::vector<double>& weights) const {
+            choices.clear();
+            weights.clear();
+            for (auto& s : steps) {
+                choices.push_back(rndgen.Integer(s.n_choices()));
+                if (s.interpolate) {
+                    for (size_t k = 0; k < s.candidates[choices.back()].size(); ++k) weights.push_back(rndgen.Uniform(1));
+                }
+            }
+        }
+
+        // number of distinct discrete models, 0 if too many to be enumerated
+        // (more than 2^53, so that indices are exact also as doubles)
+        ULong64_t n_combinations() const {
+            const ULong64_t max = ULong64_t(1) << 53;
+            ULong64_t n = 1;
+            for (auto& s : steps) {
+                if (n > max/s.n_choices()) return 0;
+                n *= s.n_choices();
+            }
+            return n;
+        }
+
+        // choices of the combination with index combo, the first step being
+        // the least significant digit
+        void decode(ULong64_t combo, std::vector<UInt_t>& choices) const {
+            choices.clear();
+            for (auto& s : steps) {
+                choices.push_back(combo % s.n_choices());
+                combo /= s.n_choices();
+            }
+        }
+
+        // inverse of decode()
+        ULong64_t encode(const std::vector<UInt_t>& choices) const {
+            ULong64_t combo = 0;
+            for (size_t i = steps.size(); i-- > 0;) combo = combo*steps[i].n_choices() + choices[i];
+            return combo;
+        }
+
+        // Interpolation with unitary distortion
+        //
+        // Must be used with care, as it modifies the prior on the distortions
+        // from a certain group.  After a discrete (user input) distortion is
+        // selected, a random number w in [0,1] is drawn.  This number w
+        // defines the admixture of the distortion D with the unitary
+        // distortion U according to the following simple formula:
+        //
+        //     pdf' = pdf * [ w * D + (1-w) * U ]
+        //
+        // comp_list must be the model the plan was compiled for, and factory
+        // must hold it, as left by ResetToBase(). As long as a component was
+        // not distorted by a previous step, the endpoints of the
+        // interpolation are known and pdf' = pdf/|pdf| + w*delta, whose
+        // integral in the counts range is range0 + w*range1. A component
+        // distorted by a single distortion is then updated directly in the
+        // model, in one pass over its support that reads the shape and the
+        // distortion (or delta) once:
+        //
+        //     model += pdf*(coef*D - base_coef)
+        //     model += (c/|pdf| - base_coef)*pdf + c*w*delta,  c = counts/(range0 + w*range1)
+        //
+        // Otherwise the distortions are applied in turn to a private copy of
+        // the shape, which then replaces the component in the factory
+        //
+        // returns the number of distortions that were skipped as they do not
+        // change the shape
+        size_t apply(GerdaFastFactory& factory, const std::vector<utils::bkg_comp>& comp_list,
+                     const std::vector<UInt_t>& choices, const std::vector<double>& weights) const {
+
+            // the distortions that change the model, in order, with their
+            // weight if interpolating
+            struct chosen { const target* t; bool interpolate; double weight; };
+            std::vector<chosen> todo;
+            std::vector<int> n_todo(comp_list.size(), 0);
+
+            size_t w = 0, elided = 0;
+            for (size_t i = 0; i < steps.size(); ++i) {
+                auto& s = steps[i];
+                auto choice = choices[i];
+
+                if (choice == s.candidates.size()) {
+                    logging_out(logging::detail) << "'" << s.name << "': stay with current PDF" << std::endl;
+                    continue;
+                }
+                logging_out(logging::detail) << "'" << s.name << "': chosen random distortion '" << s.labels[choice]
+                                              << "'" << (s.interpolate ? " -> interpolate" : "") << std::endl;
+
+                for (auto& t : s.candidates[choice]) {
+                    // the weight is drawn anyway
+                    auto weight = s.interpolate ? weights[w++] : 0;
+                    if (t.type != general) {
+                        ++elided;
+                        continue;
+                    }
+                    todo.push_back({&t, s.interpolate, weight});
+                    ++n_todo[t.comp];
+                }
+            }
+
+            std::map<size_t, utils::bkg_comp> copies;
+            for (auto& d : todo) {
+                auto& t = *d.t;
+                auto& comp = comp_list[t.comp];
+                if (comp.counts == 0) continue;
+                // all operations restricted to the component support
+                auto& supp = comp.support;
+
+                if (d.interpolate) {
+                    logging_out(logging::debug) << "distorting component '" << comp.name
+                                                 << "' with weight = " << d.weight << std::endl;
+                }
+                else logging_out(logging::debug) << "distorting component '" << comp.name << "'" << std::endl;
+
+                if (n_todo[t.comp] == 1) {
+                    if (d.interpolate) {
+                        auto c = comp.counts/(t.range0 + d.weight*t.range1);
+                        factory.AddToModel(*comp.hist, c/t.norm - t.base_coef, *t.delta, c*d.weight, supp);
+                    }
+                    else factory.AddProductToModel(*comp.hist, *t.hist, t.coef, -t.base_coef, supp);
+                    continue;
+                }
+
+                // private copy of the shape, from here on
+                auto copy = copies.find(t.comp);
+                bool first = copy == copies.end();
+                if (first) copy = copies.emplace(t.comp, comp).first;
+                auto& hist = copy->second.modify();
+                if (d.interpolate) {
+                    // hist + (1/norm - 1)*hist + w*delta, in a single pass
+                    if (first) sparse::add(hist, hist, 1/t.norm - 1, *t.delta, d.weight, supp);
+                    else sparse::interpolate(hist, *t.hist, d.weight, supp);
+                }
+                else sparse::multiply(hist, *t.hist, supp);
+            }
+
+            for (auto& c : copies) {
+                factory.ReplaceComponent(c.first, c.second.hist.get(), c.second.counts, c.second.support);
+            }
+
+            return elided;
+        }
+    };
+
+    // targets are referenced by component id, i.e. by position in the
+    // component list (the undistorted model) the plan is applied to. factory
+    // holds that model as base, and gives the normalization of the components
+    plan compile(json& config, const bank& b, const std::vector<utils::bkg_comp>& comp_list,
+                 const utils::component_index& index, const GerdaFastFactory& factory) {
+        plan p;
+
+        // distortions are classified on the component support. Interpolation
+        // endpoints and model coefficients are computed from the undistorted
+        // shapes
+        auto add_target = [&](std::vector<target>& cand, size_t comp, const TH1* hist, bool interpolate) {
+            auto& base_axis = *comp_list[comp].hist->GetXaxis();
+            if (hist->GetNbinsX() != comp_list[comp].hist->GetNbinsX() or hist->GetXaxis()->GetXmin() != base_axis.GetXmin()
+                or hist->GetXaxis()->GetXmax() != base_axis.GetXmax()) {
+                throw std::runtime_error("a distortion of component '" + comp_list[comp].name
+                        + "' has a different binning than the component");
+            }
+            target t{comp, hist, general, 0, nullptr, 0, 0, 0, 0};
+            double c;
+            if (sparse::constant(*hist, comp_list[comp].support, c) and c > 0) {
+                t.type = c == 1 ? identity : scale;
+                if (t.type == identity) ++p.n_identity;
+                else ++p.n_scale;
+            }
+            ++p.n_targets;
+            if (interpolate and t.type == general) {
+                auto& base = *comp_list[comp].hist;
+                auto& supp = comp_list[comp].support;
+                t.norm = sparse::integral(base, supp);
+                t.delta.reset(dynamic_cast<TH1*>(base.Clone()));
+                sparse::interpolate(*t.delta, *hist, 1, supp);
+                sparse::add(*t.delta, base, -1/t.norm, supp);
+            }
+            auto counts = comp_list[comp].counts;
+            if (t.type == general and counts > 0) {
+                auto& base = *comp_list[comp].hist;
+                auto& supp = comp_list[comp].support;
+                t.base_coef = counts/factory.GetNormalization(base, supp);
+                if (interpolate) {
+                    t.range0 = factory.GetNormalization(base, supp)/t.norm;
+                    t.range1 = factory.GetNormalization(*t.delta, supp);
+                }
+                else {
+                    std::unique_ptr<TH1> distorted(dynamic_cast<TH1*>(base.Clone()));
+                    sparse::multiply(*distorted, *hist, supp);
+                    auto norm = factory.GetNormalization(*distorted, supp);
+                    if (!(norm > 0)) {
+                        throw std::runtime_error("a distortion leaves component '" + comp_list[comp].name
+                                + "' with null integral in the counts range");
+                    }
+                    t.coef = counts/norm;
+                }
+            }
+            cand.push_back(t);
+        };
+
+        auto new_step = [&](json::iterator it) {
+            if (it.value().contains("interpolate") and !it.value()["interpolate"].is_boolean()) {
+                throw std::runtime_error("'interpolate' must be a boolean in distortion '" + it.key() + "'");
+            }
+            step s;
+            s.name = it.key();
+            s.interpolate = it.value().value("interpolate", false);
+            for (auto& l : it.value()["pdfs"]) s.labels.push_back(l.get<std::string>());
+            return s;
+        };
+
+        auto& dconfig = config["pdf-distortions"];
+
+        if (dconfig["global"].is_object()) {
+            for (auto it = dconfig["global"].begin(); it != dconfig["global"].end(); ++it) {
+                auto s = new_step(it);
+                for (auto& cand : b.global.at(it.key())) {
+                    s.candidates.emplace_back();
+                    for (auto& d : cand) add_target(s.candidates.back(), d.id, d.hist.get(), s.interpolate);
+                }
+                p.steps.push_back(std::move(s));
+            }
+        }
+
+        if (dconfig["specific"].is_object()) {
+            for (auto it = dconfig["specific"].begin(); it != dconfig["specific"].end(); ++it) {
+                // components not in the model are not in the bank
+                auto hists = b.specific.find(it.key());
+                if (hists == b.specific.end()) continue;
+                auto s = new_step(it);
+                auto comp = index.at(it.key());
+                for (auto& h : hists->second) {
+                    s.candidates.emplace_back();
+                    add_target(s.candidates.back(), comp, h.get(), s.interpolate);
+                }
+                p.steps.push_back(std::move(s));
+            }
+        }
+
+        if (p.steps.empty()) logging_out(logging::warning) << "no distortion will be applied!" << std::endl;
+
+        return p;
+    }
+
+    namespace {
+        // a*b mod n without overflow, for n < 2^63
+        ULong64_t mulmod(ULong64_t a, ULong64_t b, ULong64_t n) {
+            ULong64_t r = 0;
+            a %= n;
+            for (; b > 0; b >>= 1) {
+                if (b & 1) { r += a; if (r >= n) r -= n; }
+                a += a; if (a >= n) a -= n;
+            }
+            return r;
+        }
+
+        ULong64_t gcd(ULong64_t a, ULong64_t b) {
+            while (b > 0) { auto t = a % b; a = b; b = t; }
+            return a;
+        }
+    }
+
+    // Stratified assignment of experiments to the n discrete combinations
+    //
+    // Experiments are split in blocks of n consecutive indices (the first
+    // block starting at experiment 0) and each block visits every
+    // combination exactly once, in the order given by the random affine
+    // permutation j -> (a*j + b) mod n, with a coprime to n, drawn from the
+    // block's own stream. Any run of experiments thus contains every
+    // combination in the right proportion up to one unit, and if n is larger
+    // than the number of experiments no combination is drawn twice. As for
+    // the random choices, the combination only depends on the seed and on
+    // the experiment index
+    ULong64_t stratified_combination(ULong64_t seed, UInt_t experiment, ULong64_t n) {
+        if (n <= 1) return 0;
+        GerdaRandom rndgen(seed);
+        rndgen.SetStream(experiment / n, GerdaRandom::stratification);
+        ULong64_t a;
+        do a = 1 + std::min(ULong64_t(rndgen.Rndm()*(n-1)), n-2);
+        while (gcd(a, n) != 1);
+        auto b = std::min(ULong64_t(rndgen.Rndm()*n), n-1);
+        return (mulmod(a, experiment % n, n) + b) % n;
+    }
+
+    // least recently used cache of assembled (rebinned) models, keyed by the
+    // tuple of discrete distortion choices. The least recently used entries
+    // are dropped when the memory taken exceeds max_bytes
+    class model_cache {
+
+        public:
+
+        typedef std::vector<UInt_t> key_type;
+
+        explicit model_cache(size_t max_bytes) :
+            _max_bytes(max_bytes), _bytes(0), _hits(0), _misses(0) {}
+
+        inline bool enabled() const { return _max_bytes > 0; }
+
+        // nullptr if not cached
+        const GerdaFastFactory::snapshot* get(const key_type& key) {
+            auto it = _index.find(key);
+            if (it == _index.end()) {
+                ++_misses;
+                return nullptr;
+            }
+            ++_hits;
+            _entries.splice(_entries.begin(), _entries, it->second);
+            return &it->second->second;
+        }
+
+        void put(const key_type& key, GerdaFastFactory::snapshot snap) {
+            if (_index.count(key) > 0) return;
+            auto b = bytes(key, snap);
+            if (b > _max_bytes) return;
+
+            _entries.emplace_front(key, std::move(snap));
+            _index[key] = _entries.begin();
+            _bytes += b;
+
+            while (_bytes > _max_bytes) {
+                auto& last = _entries.back();
+                _bytes -= bytes(last.first, last.second);
+                _index.erase(last.first);
+                _entries.pop_back();
+            }
+        }
+
+        inline size_t size() const { return _entries.size(); }
+        inline size_t bytes() const { return _bytes; }
+        inline size_t hits() const { return _hits; }
+        inline size_t misses() const { return _misses; }
+        inline double hit_rate() const { return _hits + _misses > 0 ? double(_hits)/(_hits + _misses) : 0; }
+
+        private:
+
+        // the key is stored twice, in the list and in the index
+        static size_t bytes(const key_type& key, const GerdaFastFactory::snapshot& snap) {
+            return snap.bytes() + 2*(sizeof(key_type) + key.capacity()*sizeof(UInt_t));
+        }
+
+        size_t _max_bytes, _bytes, _hits, _misses;
+        std::list<std::pair<key_type, GerdaFastFactory::snapshot>> _entries;
+        std::map<key_type, std::list<std::pair<key_type, GerdaFastFactory::snapshot>>::iterator> _index;
+    };
+}
+
+#endif
@@ -0,0 +1,293 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <getopt.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "TROOT.h"
+#include "TFile.h"
+#include "utils.hpp"
+
+namespace logging = utils::logging;
+
+namespace {
+
+    // one distorted PDF file, divided by its baseline counterpart
+    struct work_item {
+        std::string distorted;
+        std::string baseline;
+        std::string output;
+        // file size, as an estimate of the work
+        off_t size;
+    };
+
+    std::vector<std::pair<std::string, off_t>> root_files;
+    // release archives, each must have been extracted by get-pdfs
+    std::vector<std::string> tarballs;
+
+    int collect(const char* path, const struct stat* st, int type, struct FTW*) {
+        std::string p(path);
+        if (type != FTW_F) return 0;
+        if (p.size() > 5 and p.compare(p.size() - 5, 5, ".root") == 0) root_files.emplace_back(p, st->st_size);
+        else if (p.size() > 7 and p.compare(p.size() - 7, 7, ".tar.xz") == 0) tarballs.push_back(p);
+        return 0;
+    }
+
+    // mkdir -p, safe to be called concurrently on overlapping paths
+    void make_dirs(const std::string& path) {
+        for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+            auto dir = path.substr(0, pos);
+            if (mkdir(dir.c_str(), 0755) != 0 and errno != EEXIST) {
+                throw std::runtime_error("could not create directory " + dir);
+            }
+            if (pos == std::string::npos) break;
+        }
+    }
+
+    // distorted/baseline for every histogram in hist_names. Functions (alpha
+    // PDFs) are not divided but copied from the baseline. Returns the number
+    // of objects written
+    int process(const work_item& w, const std::vector<std::string>& hist_names, std::mutex& log) {
+        TFile fdist(w.distorted.c_str());
+        TFile forig(w.baseline.c_str());
+        if (!fdist.IsOpen()) throw std::runtime_error("could not open " + w.distorted);
+        if (!forig.IsOpen()) {
+            std::lock_guard<std::mutex> lock(log);
+            logging_out(logging::warning) << "could not find " << w.baseline << ", skipping" << std::endl;
+            return 0;
+        }
+
+        make_dirs(w.output.substr(0, w.output.find_last_of('/')));
+        TFile fout(w.output.c_str(), "recreate");
+        if (!fout.IsOpen()) throw std::runtime_error("could not open " + w.output + " for writing");
+
+        int n = 0;
+        for (auto& name : hist_names) {
+            std::unique_ptr<TObject> orig(forig.Get(name.c_str()));
+            if (!orig) {
+                std::lock_guard<std::mutex> lock(log);
+                logging_out(logging::warning) << "could not find object " << name << " in " << w.baseline << std::endl;
+                continue;
+            }
+
+            // same directory structure as in the PDF files
+            auto slash = name.find_last_of('/');
+            TDirectory* dir = &fout;
+            if (slash != std::string::npos) {
+                auto dirname = name.substr(0, slash);
+                dir = fout.GetDirectory(dirname.c_str());
+                if (!dir) dir = fout.mkdir(dirname.c_str());
+            }
+            auto objname = name.substr(slash == std::string::npos ? 0 : slash + 1);
+
+            if (orig->InheritsFrom(TH1::Class())) {
+                std::unique_ptr<TH1> hdist(dynamic_cast<TH1*>(fdist.Get(name.c_str())));
+                if (!hdist) {
+                    std::lock_guard<std::mutex> lock(log);
+                    logging_out(logging::warning) << "could not find object " << name << " in " << w.distorted << std::endl;
+                    continue;
+                }
+                hdist->Divide(dynamic_cast<TH1*>(orig.get()));
+                dir->WriteTObject(hdist.get(), objname.c_str());
+                ++n;
+            }
+            // for alphas, do not calculate distortion
+            else if (orig->InheritsFrom(TF1::Class())) {
+                dir->WriteTObject(orig.get(), objname.c_str());
+                ++n;
+            }
+        }
+        return n;
+    }
+}
+
+int main(int argc, char** argv) {
+
+    TH1::AddDirectory(false);
+
+    /*
+     * get command line args
+     */
+
+    std::string progname(argv[0]);
+
+    auto usage = [&]() {
+        std::cerr << "USAGE: " << progname << " [-h|--help] [-j|--jobs N] [-p|--pdfs DIR] [-b|--baseline NAME]\n"
+                  << "       [-o|--output DIR] [-n|--hist-name NAME]... [-v|--verbose]\n"
+                  << "\n"
+                  << "Divides the PDFs of every distorted release under DIR/distorted by the ones of\n"
+                  << "the DIR/NAME baseline release and writes the ratios in the same folder structure\n"
+                  << "under the output folder. Files are processed in parallel by N threads (default:\n"
+                  << "all cores). Defaults: DIR = gerda-pdfs, NAME = gerda-pdfs-2nufit-best, output =\n"
+                  << "distortions, histograms lar/M1_enrBEGe and lar/M1_enrCoax.\n";
+    };
+
+    int n_threads = std::thread::hardware_concurrency();
+    std::string pdfs = "gerda-pdfs";
+    std::string baseline = "gerda-pdfs-2nufit-best";
+    std::string outdir = "distortions";
+    std::vector<std::string> hist_names;
+
+    const char* const short_opts = ":hj:p:b:o:n:v";
+    const option long_opts[] = {
+        { "help",      no_argument,       nullptr, 'h' },
+        { "jobs",      required_argument, nullptr, 'j' },
+        { "pdfs",      required_argument, nullptr, 'p' },
+        { "baseline",  required_argument, nullptr, 'b' },
+        { "output",    required_argument, nullptr, 'o' },
+        { "hist-name", required_argument, nullptr, 'n' },
+        { "verbose",   no_argument,       nullptr, 'v' },
+        { nullptr,     no_argument,       nullptr, 0   }
+    };
+
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'j':
+                n_threads = std::stoi(optarg);
+                break;
+            case 'p':
+                pdfs = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'n':
+                hist_names.emplace_back(optarg);
+                break;
+            case 'v':
+                logging::min_level = logging::debug;
+                break;
+            case 'h': // -h or --help
+            case '?': // Unrecognized option
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc) {usage(); return 1;}
+    if (n_threads < 1) n_threads = 1;
+    if (hist_names.empty()) hist_names = {"lar/M1_enrBEGe", "lar/M1_enrCoax"};
+
+    /*
+     * collect the work: distorted/<release>/<volume>/<part>/<isotope>/<file>
+     */
+
+    auto distorted = pdfs + "/distorted";
+    if (nftw(distorted.c_str(), collect, 32, FTW_PHYS) != 0) {
+        logging_out(logging::error) << "could not walk folder " << distorted
+                                    << ", did you run 'get-pdfs' first?" << std::endl;
+        return 1;
+    }
+
+    for (auto& t : tarballs) {
+        struct stat st;
+        auto dir = t.substr(0, t.size() - 7);
+        if (stat(dir.c_str(), &st) != 0 or !S_ISDIR(st.st_mode)) {
+            logging_out(logging::error) << t << " was not extracted, it seems that you didn't run 'get-pdfs' first" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<work_item> work;
+    for (auto& f : root_files) {
+        // path relative to the distorted folder, split in components
+        std::vector<std::string> comps;
+        std::string rel = f.first.substr(distorted.size() + 1);
+        for (size_t start = 0, end = 0; end != std::string::npos; start = end + 1) {
+            end = rel.find('/', start);
+            comps.push_back(rel.substr(start, end == std::string::npos ? end : end - start));
+        }
+        if (comps.size() < 5) {
+            logging_out(logging::debug) << "skipping " << f.first << ", not a PDF file" << std::endl;
+            continue;
+        }
+        auto n = comps.size();
+        auto basepath = comps[n-4] + "/" + comps[n-3] + "/" + comps[n-2] + "/" + comps[n-1];
+        work.push_back({f.first, pdfs + "/" + baseline + "/" + basepath, outdir + "/" + comps[n-5] + "/" + basepath, f.second});
+    }
+
+    if (work.empty()) {
+        logging_out(logging::error) << "no distorted PDFs found under " << distorted
+                                    << ", did you run 'get-pdfs' first?" << std::endl;
+        return 1;
+    }
+
+    // largest files first, and each thread takes the next file as soon as it
+    // is done with the previous one: no thread is left with a long tail
+    std::sort(work.begin(), work.end(), [](const work_item& a, const work_item& b) { return a.size > b.size; });
+
+    n_threads = std::min<int>(n_threads, work.size());
+    logging_out(logging::info) << "computing distortions for " << work.size() << " PDFs with "
+                               << n_threads << " threads" << std::endl;
+
+    /*
+     * thread pool, every file is read, divided and written by one thread
+     */
+
+    ROOT::EnableThreadSafety();
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> n_written(0), n_failed(0);
+    std::mutex log;
+
+    auto worker = [&]() {
+        for (size_t k = next++; k < work.size(); k = next++) {
+            try {
+                auto n = process(work[k], hist_names, log);
+                n_written += n;
+                if (n == 0) continue;
+                std::lock_guard<std::mutex> lock(log);
+                logging_out(logging::debug) << "written " << work[k].output << std::endl;
+            }
+            catch (const std::exception& e) {
+                ++n_failed;
+                std::lock_guard<std::mutex> lock(log);
+                logging_out(logging::error) << e.what() << std::endl;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 0; t < n_threads; ++t) pool.emplace_back(worker);
+    for (auto& t : pool) t.join();
+
+    logging_out(logging::info) << n_written << " distortions written under " << outdir << "/" << std::endl;
+    if (n_failed > 0) {
+        logging_out(logging::error) << n_failed << " files could not be processed" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
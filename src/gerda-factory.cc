@@ -24,16 +24,26 @@
 #include <algorithm>
 #include <getopt.h>
 
-#include "TRandom3.h"
 #include "TObjArray.h"
+#include "TTree.h"
 #include "utils.hpp"
 #include "progressbar.hpp"
+#include "distortions.hpp"
 
 #include "GerdaFactory.h"
 #include "GerdaFastFactory.h"
+#include "GerdaRandom.h"
 
 namespace logging = utils::logging;
 
+// how the discrete distortions of the experiments are chosen
+enum sampling_mode { random_choice, stratified };
+
+NLOHMANN_JSON_SERIALIZE_ENUM(sampling_mode, {
+    {random_choice, "random"},
+    {stratified,    "stratified"},
+})
+
 int main(int argc, char** argv) {
 
     TH1::AddDirectory(false);
@@ -45,18 +55,31 @@ int main(int argc, char** argv) {
     std::string progname(argv[0]);
 
     auto usage = [&]() {
-        std::cerr << "USAGE: " << progname << " [-h|--help] json-config\n";
+        std::cerr << "USAGE: " << progname << " [-h|--help] [-s|--seed N] [-f|--first-experiment I] json-config\n";
     };
 
-    const char* const short_opts = ":h";
+    // experiment i only depends on (seed, i): a run can be split among jobs
+    // by giving them the same seed and disjoint --first-experiment ranges
+    auto seed = GerdaRandom::RandomSeed();
+    int first_exp = 0;
+
+    const char* const short_opts = ":hs:f:";
     const option long_opts[] = {
-        { "help",  no_argument, nullptr, 'h' },
-        { nullptr, no_argument, nullptr, 0   }
+        { "help",             no_argument,       nullptr, 'h' },
+        { "seed",             required_argument, nullptr, 's' },
+        { "first-experiment", required_argument, nullptr, 'f' },
+        { nullptr,            no_argument,       nullptr, 0   }
     };
 
     int opt = 0;
     while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
         switch (opt) {
+            case 's':
+                seed = std::stoull(optarg);
+                break;
+            case 'f':
+                first_exp = std::stoi(optarg);
+                break;
             case 'h': // -h or --help
             case '?': // Unrecognized option
             default:
@@ -87,7 +110,10 @@ int main(int argc, char** argv) {
      * create experiment factory
      */
 
+    logging_out(logging::info) << "random seed: " << seed << std::endl;
+
     GerdaFastFactory factory;
+    factory.SetSeed(seed);
 
     // set range for counts
     if (config["range-for-counts"].is_array()) {
@@ -97,11 +123,38 @@ int main(int argc, char** argv) {
         );
     }
 
+    // per-bin Poisson tables, for models that (mostly) do not change between
+    // the experiments
+    factory.SetPoissonTables(config.value("poisson-tables", false));
+
     // parse and build reference model
     logging_out(logging::detail) << "getting base component list from JSON config" << std::endl;
-    auto comp_list = utils::get_components_json(config);
-    // save it (deep copy), we'll need it after resetting the factory before the next iterations
-    const auto comp_list_save = utils::deep_copy(comp_list);
+    // never modified, distortions are applied to the model in the factory
+    // (or to private copies of the components)
+    const auto comp_list = utils::get_components_json(config);
+
+    if (comp_list.empty()) throw std::runtime_error("no components found in the config file");
+
+    // experiments are generated directly at the output binning, from the
+    // rebinned model
+    auto n_orig_bins = comp_list.front().hist->GetNbinsX();
+    auto ref_axis = comp_list.front().hist->GetXaxis();
+    for (auto& e : comp_list) {
+        auto axis = e.hist->GetXaxis();
+        if (e.hist->GetNbinsX() != n_orig_bins or axis->GetXmin() != ref_axis->GetXmin() or axis->GetXmax() != ref_axis->GetXmax()) {
+            throw std::runtime_error("component '" + e.name + "' has a different binning than '" + comp_list.front().name + "'");
+        }
+    }
+    auto n_out_bins = config["output"]["number-of-bins"].get<int>();
+    if (n_out_bins <= 0 or n_orig_bins % n_out_bins != 0) {
+        throw std::runtime_error("\"number-of-bins\" is incompatible with reference model number of bins (" +
+                std::to_string(n_orig_bins) + ")");
+    }
+    factory.SetRebinFactor(n_orig_bins / n_out_bins);
+
+    // undistorted model, experiments only update the distorted components
+    for (auto& e : comp_list) factory.AddComponent(e.hist.get(), e.counts, e.support);
+    factory.SetBase();
 
     if (!config["pdf-distortions"].is_object()) {
         throw std::runtime_error("could not find 'pdf-distortions' field in the config file");
@@ -110,13 +163,68 @@ int main(int argc, char** argv) {
         throw std::runtime_error("please specify a 'global' and/or 'specific' field under 'pdf-distortions' in the config file");
     }
 
-    auto dist_prefix = config["pdf-distortions"].value("prefix", ".") + "/";
-    TRandom3 rndgen(0);
+    // every distortion is read from disk once, here
+    logging_out(logging::detail) << "loading distortions" << std::endl;
+    auto comp_index = utils::index_components(comp_list);
+    auto bank = distortions::load_bank(config, comp_list, comp_index);
+    logging_out(logging::info) << bank.size() << " distortion histograms loaded" << std::endl;
+
+    GerdaRandom rndgen(seed);
+
+    // validated once, the experiments only follow the plan
+    auto plan = distortions::compile(config, bank, comp_list, comp_index, factory);
+    logging_out(logging::detail) << plan.steps.size() << " distortion groups" << std::endl;
+    logging_out(logging::info) << plan.n_targets << " component distortions, of which " << plan.n_identity
+                               << " identities and " << plan.n_scale << " constant scales (skipped)" << std::endl;
+
+    // in stratified mode experiments are assigned to the combinations of
+    // discrete choices in equal proportions, instead of drawing the choices
+    auto sampling = config["pdf-distortions"].value("sampling", random_choice);
+    ULong64_t n_combos = 0;
+    if (sampling == stratified) {
+        if (!plan.discrete()) {
+            throw std::runtime_error("stratified sampling is only possible without interpolated distortions");
+        }
+        n_combos = plan.n_combinations();
+        if (n_combos == 0) throw std::runtime_error("too many combinations of distortions to be stratified");
+        logging_out(logging::info) << "stratified sampling over " << n_combos << " combinations of distortions" << std::endl;
+    }
+
+    // with interpolation the distorted models are all different, otherwise
+    // they are determined by the discrete choices and can be reused. In
+    // stratified mode each model is built once anyway
+    auto cache_mb = config["pdf-distortions"].value("model-cache-mb", 256);
+    distortions::model_cache cache(plan.discrete() and sampling != stratified and cache_mb > 0 ? size_t(cache_mb) << 20 : 0);
 
     auto outname = utils::get_file_obj(config["output"]["file"].get<std::string>());
 
-    // container for output histograms
-    std::vector<std::unique_ptr<TH1>> experiments;
+    // output file, experiments are written as soon as they are generated
+    logging_out(logging::debug) << "opening output file" << std::endl;
+    system(("mkdir -p " + outname.first.substr(0, outname.first.find_last_of('/'))).c_str());
+    TFile fout(outname.first.c_str(), "recreate");
+
+    // output histogram, reused for all experiments
+    TH1D hout("h", "Pseudo experiment", n_out_bins, ref_axis->GetXmin(), ref_axis->GetXmax());
+
+    // each distortion draw gives toys-per-model experiments, generated in a
+    // batch from the same model: draw i gives experiments i*K to i*K+K-1
+    auto toys_per_model = config.value("toys-per-model", 1);
+    if (toys_per_model < 1) throw std::runtime_error("\"toys-per-model\" must be >= 1");
+    std::vector<int> batch(toys_per_model > 1 ? size_t(toys_per_model)*n_out_bins : 0);
+
+    // which experiments share a model: the distortion draw and, for discrete
+    // distortions, the combination of choices (-1 if not enumerable)
+    UInt_t t_exp, t_draw;
+    Long64_t t_combo = -1;
+    std::unique_ptr<TTree> tmodels;
+    if (toys_per_model > 1) {
+        tmodels.reset(new TTree(((outname.second != "" ? outname.second : "h") + "_models").c_str(),
+                                "Distorted model of each experiment"));
+        tmodels->Branch("experiment",  &t_exp,   "experiment/i");
+        tmodels->Branch("draw",        &t_draw,  "draw/i");
+        tmodels->Branch("combination", &t_combo, "combination/L");
+    }
+    const auto n_combos_all = plan.discrete() ? plan.n_combinations() : 0;
 
     auto niter = config.value("number-of-experiments", 100);
     progressbar bar(niter);
@@ -124,259 +232,110 @@ int main(int argc, char** argv) {
     bar.set_done_char("█");
     bar.set_opening_bracket_char("[");
     bar.set_closing_bracket_char("]");
-    logging_out(logging::info) << "generating " << niter << " experiments ";
+    logging_out(logging::info) << "generating " << niter << " experiments"
+                               << (toys_per_model > 1 ? " times " + std::to_string(toys_per_model) + " toys" : "") << " ";
     logging_out(logging::detail) << std::endl;
 
-    for (int i = 0; i < niter; ++i) {
+    // experiments in generation order. Stratified experiments are grouped
+    // by combination, so that each distinct model is built once; their
+    // random streams do not depend on the order
+    std::vector<std::pair<ULong64_t, int>> order;
+    for (int i = first_exp; i < first_exp + niter; ++i) {
+        auto combo = sampling == stratified ? distortions::stratified_combination(seed, i, n_combos) : 0;
+        order.emplace_back(combo, i);
+    }
+    if (sampling == stratified) std::sort(order.begin(), order.end());
+
+    auto name = [&outname](int exp) {
+        return (outname.second != "" ? outname.second : "h") + "_" + std::to_string(exp);
+    };
+
+    std::vector<UInt_t> choices;
+    std::vector<double> weights;
+    size_t n_elided = 0, n_models = 0;
+    for (size_t o = 0; o < order.size(); ++o) {
+        auto i = order[o].second;
         if (logging::min_level > logging::detail) bar.update();
-        // reset model from last iteration
-        factory.Reset();
-        comp_list.clear();
-        // we restart from base model
-        comp_list = utils::deep_copy(comp_list_save);
-
-        bool done_something = false;
-        // for distortions given with gerda-pdfs structure
-        if (config["pdf-distortions"]["global"].is_object()) {
-            logging_out(logging::detail) << "applying 'global' distortions" << std::endl;
-            for (auto& it : config["pdf-distortions"]["global"].items()) {
-
-                bool interpolate = false;
-                if (it.value().contains("interpolate")) {
-                    if (it.value()["interpolate"].get<bool>() == true) interpolate = true;
-                }
-
-                // Interpolation with unitary distortion
-                //
-                // Must be used with care, as it modifies the prior on the
-                // distortions from a certain group.  After a discrete (user
-                // input) distortion is selected, a random number w in [0,1] is
-                // drawn.  This number w defines the admixture of the
-                // distortion D with the unitary distortion U according to the
-                // following simple formula:
-                //
-                //     pdf' = pdf * [ w * D + (1-w) * U ]
-                if (interpolate) {
-                    logging_out(logging::debug) << "randomly choosing a distortion for '" << it.key()
-                                                 << "' and interpolating with the unitary distortion" << std::endl;
-                    // first choose a discrete distortion randomly
-                    auto choice = rndgen.Integer(it.value()["pdfs"].size());
-                    logging_out(logging::detail) << "chosen random distortion: '"
-                                                  << it.value()["pdfs"][choice].get<std::string>()
-                                                  << "'" << (interpolate ? " -> interpolate" : "") << std::endl;
-
-                    // get histograms. discard user files here because by
-                    // definition global distortions apply to components coming
-                    // from gerda-pdfs *only*
-                    auto dist_list = utils::get_components_json(config, dist_prefix + it.value()["pdfs"][choice].get<std::string>(), true);
-                    for (auto itt = dist_list.begin(); itt != dist_list.end(); itt++) {
-                        // see if we have a corresponding fit component
-                        auto result = std::find_if(
-                            comp_list.begin(), comp_list.end(),
-                            [&itt](utils::bkg_comp& a) { return a.name == itt->name; }
-                        );
-
-                        // then choose a distortion weight
-                        if (result != comp_list.end()) {
-                            auto weight = rndgen.Uniform(1);
-                            logging_out(logging::debug) << "successfully found corresponding fit component '" << itt->name
-                                                   << "', distorting with weight = " << weight << std::endl;
-
-                            std::unique_ptr<TH1> result_tmp(dynamic_cast<TH1*>(result->hist->Clone()));
-                            result_tmp->Multiply(itt->hist.get());
-                            result_tmp->Scale(weight/result_tmp->Integral());
-
-                            result->hist->Scale((1-weight)/result->hist->Integral());
-                            result->hist->Add(result_tmp.get());
-
-                            done_something = true;
-                        }
-                        else {
-                            logging_out(logging::warning) << "could not find component '" << it.key()
-                                                           << "' to distort" << std::endl;
-                        }
-                    }
-                }
-                else {
-                    logging_out(logging::debug) << "randomly choosing a discrete distortion for '" << it.key() << "'" << std::endl;
-                    // choose a distortion randomly
-                    // the +1 corresponds to no distortion applied
-                    auto choice = rndgen.Integer(it.value()["pdfs"].size()+1);
-                    if (choice != it.value()["pdfs"].size()) {
-                        logging_out(logging::detail) << "chosen random distortion: '"
-                                                      << it.value()["pdfs"][choice].get<std::string>()
-                                                      << "'" << std::endl;
-
-                        // get histograms. discard user files here because by
-                        // definition global distortions apply to components coming
-                        // from gerda-pdfs *only*
-                        auto dist_list = utils::get_components_json(config, dist_prefix + it.value()["pdfs"][choice].get<std::string>(), true);
-                        for (auto itt = dist_list.begin(); itt != dist_list.end(); itt++) {
-                            // see if we have a corresponding fit component
-                            auto result = std::find_if(
-                                    comp_list.begin(), comp_list.end(),
-                                    [&itt](utils::bkg_comp& a) { return a.name == itt->name; }
-                                    );
-
-                            // distort
-                            if (result != comp_list.end()) {
-                                logging_out(logging::debug) << "successfully found corresponding fit component '" << itt->name
-                                                             << "', distorting (with component labeled '" << itt->name << "'"
-                                                             << " hist->GetName() == '" << itt->hist->GetName() << "')" << std::endl;
-                                result->hist->Multiply(itt->hist.get());
-                                done_something = true;
-                            }
-                            else {
-                                logging_out(logging::warning) << "could not find component '" << it.key()
-                                                               << "' to distort" << std::endl;
-                            }
-                        }
-                    }
-                    // no distortion applied
-                    else {
-                        logging_out(logging::detail) << "chosen random distortion: "
-                                                      << "stay with current PDF" << std::endl;
-                        done_something = true;
-                    }
-                }
-            }
+        factory.SetExperimentIndex(i);
+
+        bool new_model = true;
+        if (sampling == stratified) {
+            // same combination as the previous experiment, same model
+            new_model = o == 0 or order[o].first != order[o-1].first;
+            if (new_model) plan.decode(order[o].first, choices);
+            weights.clear();
         }
-        // for distortions given for single components
-        if (config["pdf-distortions"]["specific"].is_object()) {
-            logging_out(logging::detail) << "applying 'specific' distortions" << std::endl;
-            for (auto& it : config["pdf-distortions"]["specific"].items()) {
-
-                // see if we have a corresponding fit component
-                auto result = std::find_if(
-                    comp_list.begin(), comp_list.end(),
-                    [&it](utils::bkg_comp& a) { return a.name == it.key(); }
-                );
-
-                if (result == comp_list.end()) {
-                    logging_out(logging::warning) << "could not find component '" << it.key()
-                                                   << "' to distort" << std::endl;
-                    continue;
-                }
-                else {
-                    logging_out(logging::debug) << "successfully found corresponding fit component '" << it.key()
-                                                 << "'" << std::endl;
-                }
-
-                bool interpolate = false;
-                if (it.value().contains("interpolate")) {
-                    if (it.value()["interpolate"].get<bool>() == true) interpolate = true;
-                }
-
-                // which hist-name to use?
-                std::string hist_name = it.value().value("hist-name", (*result).orig_name);
-
-                if (hist_name.empty()) {
-                    throw std::runtime_error("I have no clue which histogram to read for '"
-                            + it.key() + "'specific distortions!");
-                }
-
-                // Interpolate with unitary distortion
-                if (interpolate) {
-                    logging_out(logging::debug) << "randomly choosing a discrete distortion for '"
-                                                << it.key() << "and interpolating with the unitary distortion" << std::endl;
-                    // choose a distortion randomly
-                    auto choice = rndgen.Integer(it.value()["pdfs"].size());
-
-                    if (it.value()["pdfs"][choice].is_string()) {
-                        logging_out(logging::detail) << "chosen random distortion: '"
-                                                     << it.value()["pdfs"][choice].get<std::string>()
-                                                     << "'" << (interpolate ? " -> interpolate" : "") << std::endl;
-
-                        auto hdist = utils::get_component(
-                            dist_prefix + it.value()["pdfs"][choice].get<std::string>(),
-                            hist_name,
-                            8000, 0, 8000
-                        );
-
-                        auto weight = rndgen.Uniform(1);
-                        logging_out(logging::debug) << "distorting with weight = " << weight << std::endl;
-
-                        std::unique_ptr<TH1> result_tmp(dynamic_cast<TH1*>(result->hist->Clone()));
-                        result_tmp->Multiply(hdist.get());
-                        result_tmp->Scale(weight/result_tmp->Integral());
-
-                        result->hist->Scale((1-weight)/result->hist->Integral());
-                        result->hist->Add(result_tmp.get());
-
-                        done_something = true;
-                    }
-                    else {
-                        throw std::runtime_error("elements in arrays of distortions must be strings");
-                    }
-                }
-                else {
-
-                    logging_out(logging::debug) << "randomly choosing a discrete distortion for '"
-                                                 << it.key() << std::endl;
-                    // choose a distortion randomly
-                    // the +1 corresponds to no distortion applied
-                    auto choice = rndgen.Integer(it.value()["pdfs"].size()+1);
-
-                    if (choice != it.value()["pdfs"].size()) {
-                        if (it.value()["pdfs"][choice].is_string()) {
-                            logging_out(logging::detail) << "chosen random distortion: '"
-                                                          << it.value()["pdfs"][choice].get<std::string>()
-                                                          << "'" << std::endl;
-                            auto hdist = utils::get_component(
-                                dist_prefix + it.value()["pdfs"][choice].get<std::string>(),
-                                hist_name,
-                                8000, 0, 8000
-                            );
-                            logging_out(logging::debug) << "distorting" << std::endl;
-                            result->hist->Multiply(hdist.get());
-                            done_something = true;
-                        }
-                        else {
-                            throw std::runtime_error("elements in arrays of distortions must be strings");
-                        }
-                    }
-                    // no distortion applied
-                    else {
-                        logging_out(logging::detail) << "chosen random distortion: "
-                                                      << "stay with current PDF" << std::endl;
-                        done_something = true;
-                    }
-                }
-            }
+        else {
+            // draw all the random choices of this experiment first: for each
+            // distortion group the index of the chosen distortion and, if
+            // interpolating, one weight per distorted component
+            rndgen.SetStream(i, GerdaRandom::distortion);
+            plan.draw(rndgen, choices, weights);
         }
-        if (!done_something) logging_out(logging::warning) << "did not distort anything!" << std::endl;
 
-        // add components to the factory
-        for (auto& e : comp_list) factory.AddComponent(e.hist.get(), e.counts);
+        // same discrete choices, same model
+        auto cached = new_model and cache.enabled() ? cache.get(choices) : nullptr;
+        if (cached) {
+            logging_out(logging::detail) << "distorted model found in cache" << std::endl;
+            factory.Restore(*cached);
+        }
+        else if (new_model) {
+            // we restart from base model, only the distorted components
+            // are updated
+            factory.ResetToBase();
+            n_elided += plan.apply(factory, comp_list, choices, weights);
+            ++n_models;
+
+            if (cache.enabled()) cache.put(choices, factory.GetSnapshot());
+        }
 
-        // now generate the experiment
+        // now generate the experiment(s)
         logging_out(logging::detail) << "filling output histogram" << std::endl;
 
-        experiments.push_back(factory.GetPseudoExp());
-        auto hexp = experiments.back().get();
+        if (toys_per_model == 1) {
+            factory.FillPseudoExp(hout);
 
-        int n_orig_bins = factory.GetModel()->GetNbinsX();
+            hout.SetName(name(i).c_str());
+            fout.WriteTObject(&hout);
 
-        if (n_orig_bins % config["output"]["number-of-bins"].get<int>() != 0) {
-            throw std::runtime_error("\"number-of-bins\" is incompatible with reference model number of bins (" +
-                    std::to_string(n_orig_bins) + ")");
+            logging_out(logging::debug) << "object " << hout.GetName()
+                                         << " written to file " << std::endl;
+            continue;
         }
-        else hexp->Rebin(n_orig_bins / config["output"]["number-of-bins"].get<int>());
-
-        hexp->SetName(((outname.second != "" ? outname.second : "h") + "_" + std::to_string(i)).c_str());
-        hexp->SetTitle("Pseudo experiment");
 
-        logging_out(logging::debug) << "object " << hexp->GetName()
-                                     << " added to collection " << std::endl;
+        factory.GenerateBatch(toys_per_model, batch.data());
+        t_draw = i;
+        t_combo = n_combos_all > 0 ? Long64_t(plan.encode(choices)) : -1;
+        for (int k = 0; k < toys_per_model; ++k) {
+            hout.Reset("ICES");
+            auto row = batch.data() + size_t(k)*n_out_bins;
+            for (int b = 0; b < n_out_bins; ++b) hout.SetBinContent(b+1, row[b]);
+
+            t_exp = i*toys_per_model + k;
+            hout.SetName(name(t_exp).c_str());
+            fout.WriteTObject(&hout);
+            tmodels->Fill();
+
+            logging_out(logging::debug) << "object " << hout.GetName()
+                                         << " written to file " << std::endl;
+        }
     }
 
-    // output file
-    logging_out(logging::debug) << "opening output file" << std::endl;
-    system(("mkdir -p " + outname.first.substr(0, outname.first.find_last_of('/'))).c_str());
-    TFile fout(outname.first.c_str(), "recreate");
-    for (const auto& e : experiments) dynamic_cast<TH1D*>(e.get())->Write();
+    if (tmodels) {
+        fout.cd();
+        tmodels->Write();
+        tmodels.reset();
+    }
     fout.Close();
 
+    logging_out(logging::info) << n_models << " distorted models built, " << n_elided
+                               << " distortions skipped as identities or constant scales" << std::endl;
+    if (cache.enabled()) {
+        logging_out(logging::info) << "model cache: " << cache.hits() << " hits, " << cache.misses() << " misses (hit rate "
+                                   << 100*cache.hit_rate() << "%), " << cache.size() << " models in "
+                                   << cache.bytes()/1024 << " kB" << std::endl;
+    }
+
     logging_out(logging::debug) << "exiting" << std::endl;
 
     return 0;
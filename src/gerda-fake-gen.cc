@@ -23,11 +23,27 @@
 #include <iostream>
 #include <getopt.h>
 
+#include "TTree.h"
+
 #include "utils.hpp"
 namespace logs = utils::logging;
 
 #include "GerdaFactory.h"
 
+NLOHMANN_JSON_SERIALIZE_ENUM(GerdaFactory::gen_mode, {
+    {GerdaFactory::alias,       "alias"},
+    {GerdaFactory::get_random,  "get-random"},
+    {GerdaFactory::multinomial, "multinomial"},
+})
+
+// binned spectrum or list of events
+enum output_format { histogram, events };
+
+NLOHMANN_JSON_SERIALIZE_ENUM(output_format, {
+    {histogram, "histogram"},
+    {events,    "events"},
+})
+
 int main(int argc, char** argv) {
 
     /*
@@ -37,18 +53,24 @@ int main(int argc, char** argv) {
     std::string progname(argv[0]);
 
     auto usage = [&]() {
-        std::cerr << "USAGE: " << progname << " [-h|--help] json-config\n";
+        std::cerr << "USAGE: " << progname << " [-h|--help] [-s|--seed N] json-config\n";
     };
 
-    const char* const short_opts = ":h";
+    auto seed = GerdaRandom::RandomSeed();
+
+    const char* const short_opts = ":hs:";
     const option long_opts[] = {
-        { "help",  no_argument, nullptr, 'h' },
-        { nullptr, no_argument, nullptr, 0   }
+        { "help",  no_argument,       nullptr, 'h' },
+        { "seed",  required_argument, nullptr, 's' },
+        { nullptr, no_argument,       nullptr, 0   }
     };
 
     int opt = 0;
     while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
         switch (opt) {
+            case 's':
+                seed = std::stoull(optarg);
+                break;
             case 'h': // -h or --help
             case '?': // Unrecognized option
             default:
@@ -79,7 +101,11 @@ int main(int argc, char** argv) {
      * create model
      */
 
+    logs::out(logs::info) << "random seed: " << seed << std::endl;
+
     GerdaFactory factory;
+    factory.SetSeed(seed);
+    factory.SetGenMode(config.value("generation-mode", GerdaFactory::alias));
 
     // eventually get a global value for the gerda-pdfs path
     auto gerda_pdfs = config.value("gerda-pdfs", ".");
@@ -96,12 +122,53 @@ int main(int argc, char** argv) {
     auto comp_list = utils::get_components_json(config);
 
     // add components to the factory
-    for (auto& e : comp_list) factory.AddComponent(e.hist, e.counts);
+    for (auto& e : comp_list) factory.AddComponent(e.hist.get(), e.counts);
 
     logs::out(logs::debug) << "opening output file" << std::endl;
     auto outname = utils::get_file_obj(config["output"]["file"].get<std::string>());
     TFile fout(outname.first.c_str(), "recreate");
 
+    if (config["output"].value("format", histogram) == events) {
+
+        // one entry per event, written out in baskets while generating
+        auto nexp = config.value("number-of-experiments", 1);
+        TTree tree((outname.second != "" ? outname.second : "events").c_str(), "Pseudo experiment events");
+        Float_t energy;
+        UShort_t comp;
+        UInt_t exp;
+        tree.Branch("energy",     &energy, "energy/F");
+        tree.Branch("component",  &comp,   "component/s");
+        tree.Branch("experiment", &exp,    "experiment/i");
+
+        logs::out(logs::detail) << "generating " << nexp << " unbinned experiments" << std::endl;
+        for (exp = 0; exp < static_cast<UInt_t>(nexp); ++exp) {
+            factory.SetExperimentIndex(exp);
+            factory.GenerateEvents([&](int c, const float* e, int n) {
+                comp = c;
+                for (int i = 0; i < n; ++i) {
+                    energy = e[i];
+                    tree.Fill();
+                }
+            });
+        }
+        tree.Write();
+
+        // names of the components, in the order given by the "component" branch
+        TTree tcomp("components", "Model components");
+        std::string name;
+        tcomp.Branch("name", &name);
+        for (auto& e : comp_list) {
+            name = e.name;
+            tcomp.Fill();
+        }
+        tcomp.Write();
+
+        logs::out(logs::info) << tree.GetEntries() << " events written to tree " << tree.GetName()
+                              << " on file " << outname.first << std::endl;
+
+        return 0;
+    }
+
     // now generate the experiment
     TH1D hexp(
         (outname.second != "" ? outname.second : "h").c_str(),
@@ -0,0 +1,162 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <iostream>
+#include <algorithm>
+#include <getopt.h>
+#include <ftw.h>
+
+#include "TFile.h"
+#include "TKey.h"
+#include "TClass.h"
+#include "utils.hpp"
+
+#include "GerdaBank.h"
+
+namespace logging = utils::logging;
+
+namespace {
+
+    std::vector<std::string> root_files;
+
+    int collect(const char* path, const struct stat*, int type, struct FTW*) {
+        std::string p(path);
+        if (type == FTW_F and p.size() > 5 and p.compare(p.size() - 5, 5, ".root") == 0) root_files.push_back(p);
+        return 0;
+    }
+
+    // paths of all the 1D histograms and functions in dir, recursively
+    void list_objects(TDirectory& dir, const std::string& path, std::vector<std::string>& objects) {
+        std::vector<std::string> seen;
+        for (auto k : *dir.GetListOfKeys()) {
+            auto key = dynamic_cast<TKey*>(k);
+            // only the highest cycle of each object
+            if (std::find(seen.begin(), seen.end(), key->GetName()) != seen.end()) continue;
+            seen.push_back(key->GetName());
+
+            auto cl = TClass::GetClass(key->GetClassName());
+            if (!cl) continue;
+            auto name = path.empty() ? std::string(key->GetName()) : path + "/" + key->GetName();
+            if (cl->InheritsFrom(TDirectory::Class())) {
+                auto sub = dir.GetDirectory(key->GetName());
+                if (sub) list_objects(*sub, name, objects);
+            }
+            else if ((cl->InheritsFrom(TH1::Class()) and !cl->InheritsFrom("TH2") and !cl->InheritsFrom("TH3"))
+                     or cl->InheritsFrom(TF1::Class())) {
+                objects.push_back(name);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+
+    TH1::AddDirectory(false);
+
+    /*
+     * get command line args
+     */
+
+    std::string progname(argv[0]);
+
+    auto usage = [&]() {
+        std::cerr << "USAGE: " << progname << " [-h|--help] [-o|--output FILE] [-v|--verbose] folder\n"
+                  << "\n"
+                  << "Packs all the histograms in the ROOT files under folder (e.g. the output of\n"
+                  << "data/compute-distortions) in a single bank file, to be used as \"prefix\" of\n"
+                  << "\"pdf-distortions\" in gerda-factory configs.\n";
+    };
+
+    std::string outname = "distortions.gdb";
+
+    const char* const short_opts = ":ho:v";
+    const option long_opts[] = {
+        { "help",    no_argument,       nullptr, 'h' },
+        { "output",  required_argument, nullptr, 'o' },
+        { "verbose", no_argument,       nullptr, 'v' },
+        { nullptr,   no_argument,       nullptr, 0   }
+    };
+
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'o':
+                outname = optarg;
+                break;
+            case 'v':
+                logging::min_level = logging::debug;
+                break;
+            case 'h': // -h or --help
+            case '?': // Unrecognized option
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    // extra arguments
+    std::vector<std::string> args;
+    for(; optind < argc; optind++){
+        args.emplace_back(argv[optind]);
+    }
+
+    if (args.size() != 1) {usage(); return 1;}
+
+    auto folder = args[0];
+    while (folder.size() > 1 and folder.back() == '/') folder.pop_back();
+
+    if (nftw(folder.c_str(), collect, 32, FTW_PHYS) != 0) {
+        logging_out(logging::error) << "could not walk folder " << folder << std::endl;
+        return 1;
+    }
+    std::sort(root_files.begin(), root_files.end());
+    logging_out(logging::info) << root_files.size() << " ROOT files found in " << folder << std::endl;
+
+    // histograms are read as gerda-factory would read them from the files,
+    // i.e. normalized to the number of primaries and with functions sampled
+    // on the distortion binning, and keyed by their path relative to folder
+    std::vector<std::unique_ptr<TH1>> hists;
+    std::vector<std::pair<std::string, const TH1*>> entries;
+    for (auto& f : root_files) {
+        std::vector<std::string> objects;
+        {
+            TFile tf(f.c_str());
+            if (!tf.IsOpen()) {
+                logging_out(logging::warning) << "could not open " << f << ", skipping" << std::endl;
+                continue;
+            }
+            list_objects(tf, "", objects);
+        }
+        auto rel = f.substr(folder.size() + 1);
+        for (auto& o : objects) {
+            hists.push_back(utils::get_component(f, o, 8000, 0, 8000));
+            entries.emplace_back(rel + ":" + o, hists.back().get());
+            logging_out(logging::debug) << "packing " << entries.back().first << std::endl;
+        }
+    }
+
+    GerdaBank::Write(outname, entries);
+    logging_out(logging::info) << entries.size() << " histograms written to " << outname << std::endl;
+
+    return 0;
+}
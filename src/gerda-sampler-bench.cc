@@ -0,0 +1,117 @@
+// MIT License
+//
+// Copyright (c) 2021 Luigi Pertoldi
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+// Compares the event samplers available in GerdaFactory on a 2nbb-like
+// spectrum (or on a user-provided histogram). Build with `make bench`
+
+#include <iostream>
+#include <chrono>
+#include <getopt.h>
+
+#include "TH1D.h"
+#include "utils.hpp"
+
+#include "GerdaFactory.h"
+
+int main(int argc, char** argv) {
+
+    TH1::AddDirectory(false);
+
+    std::string progname(argv[0]);
+
+    auto usage = [&]() {
+        std::cerr << "USAGE: " << progname << " [-h|--help] [-n|--experiments N] [-c|--counts C] [file.root:hist]\n";
+    };
+
+    int nexp = 100;
+    float counts = 46427;
+
+    const char* const short_opts = ":hn:c:";
+    const option long_opts[] = {
+        { "help",        no_argument,       nullptr, 'h' },
+        { "experiments", required_argument, nullptr, 'n' },
+        { "counts",      required_argument, nullptr, 'c' },
+        { nullptr,       no_argument,       nullptr, 0   }
+    };
+
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'n':
+                nexp = std::stoi(optarg);
+                break;
+            case 'c':
+                counts = std::stof(optarg);
+                break;
+            case 'h': // -h or --help
+            case '?': // Unrecognized option
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    std::unique_ptr<TH1> pdf;
+    if (optind < argc) {
+        auto fo = utils::get_file_obj(argv[optind]);
+        pdf = utils::get_component(fo.first, fo.second, 8000, 0, 8000);
+    }
+    else {
+        // 2nbb-like summed electron energy spectrum, Q = 2039 keV
+        pdf.reset(new TH1D("pdf", "2nbb-like", 8000, 0, 8000));
+        const double q = 2039;
+        for (int b = 1; b <= pdf->GetNbinsX(); ++b) {
+            auto x = pdf->GetBinCenter(b);
+            if (x < q) pdf->SetBinContent(b, x*std::pow(q - x, 5));
+        }
+    }
+
+    TH1D hexp("hexp", "Pseudo experiment", pdf->GetNbinsX(),
+              pdf->GetXaxis()->GetXmin(), pdf->GetXaxis()->GetXmax());
+
+    auto run = [&](GerdaFactory::gen_mode mode, std::string label) {
+        GerdaFactory factory;
+        factory.SetGenMode(mode);
+        factory.AddComponent(pdf.get(), counts);
+        hexp.Reset();
+
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nexp; ++i) factory.FillPseudoExp(hexp);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::cout << label << ": " << elapsed.count()/nexp << " ms/experiment, "
+                  << hexp.Integral()/nexp << " events/experiment on average" << std::endl;
+        return elapsed.count();
+    };
+
+    std::cout << "sampling " << nexp << " experiments with " << counts
+              << " expected counts from a " << pdf->GetNbinsX() << "-bin PDF" << std::endl;
+
+    auto t_ref = run(GerdaFactory::get_random, "TH1::GetRandom");
+    auto t_alias = run(GerdaFactory::alias, "alias table   ");
+    auto t_multi = run(GerdaFactory::multinomial, "multinomial   ");
+
+    std::cout << "speedup: " << t_ref/t_alias << " (alias table), "
+              << t_ref/t_multi << " (multinomial)" << std::endl;
+
+    return 0;
+}
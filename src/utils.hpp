@@ -23,6 +23,7 @@
 #include <iostream>
 #include <string>
 #include <memory>
+#include <unordered_map>
 
 #include "TFile.h"
 #include "TH1.h"
@@ -32,6 +33,9 @@
 #include "json.hpp"
 using json = nlohmann::json;
 
+#include "GerdaSupport.h"
+#include "GerdaBank.h"
+
 #ifndef UTILS_HH
 #define UTILS_HH
 
@@ -83,29 +87,53 @@ namespace utils {
 
     struct bkg_comp {
         std::string name;
-        std::unique_ptr<TH1> hist;
+        // shared by copies, see modify()
+        std::shared_ptr<TH1> hist;
         std::string orig_name;
         float counts;
+        // bins where hist can be non-zero
+        sparse::support support;
+        // position in the list returned by get_components_json()
+        size_t id = 0;
 
         // constructor
-        bkg_comp(const std::string& n, TH1* h, std::string& on, float c) :
-            name(n), hist(h), orig_name(on), counts(c) {}
-        // (deep) copy constructor
-        bkg_comp(const bkg_comp& orig) :
-            name(orig.name),
-            hist(dynamic_cast<TH1*>(orig.hist->Clone())),
-            orig_name(orig.orig_name),
-            counts(orig.counts) {}
+        bkg_comp(const std::string& n, TH1* h, std::string& on, float c, const sparse::support& s) :
+            name(n), hist(h), orig_name(on), counts(c), support(s) {}
+        // copies are cheap, the histogram is only cloned when a copy is
+        // going to change it
+        TH1& modify() {
+            if (hist.use_count() > 1) hist.reset(dynamic_cast<TH1*>(hist->Clone()));
+            return *hist;
+        }
     };
 
-    std::vector<bkg_comp> deep_copy(const std::vector<bkg_comp>& orig) {
-        std::vector<utils::bkg_comp> out;
-        for (auto& el : orig) out.emplace_back(el);
-        return out;
-    };
+    // component name -> id, to avoid searching the component list by name
+    typedef std::unordered_map<std::string, size_t> component_index;
 
-    // The returned raw TH1 pointer is owned by the user
-    std::unique_ptr<TH1> get_component(std::string filename, std::string objectname, int nbinsx = 100, double xmin = 0, double xmax = 100) {
+    component_index index_components(const std::vector<bkg_comp>& comp_list) {
+        component_index index;
+        index.reserve(comp_list.size());
+        for (auto& c : comp_list) {
+            if (!index.emplace(c.name, c.id).second) {
+                throw std::runtime_error("component name '" + c.name + "' is not unique");
+            }
+        }
+        return index;
+    }
+
+    // The returned raw TH1 pointer is owned by the user. If a bank is given,
+    // filename is a path inside the bank (see GerdaBank) and the histogram
+    // is taken from there as it was stored by the packer
+    std::unique_ptr<TH1> get_component(std::string filename, std::string objectname, int nbinsx = 100, double xmin = 0, double xmax = 100,
+                                       const GerdaBank* bank = nullptr) {
+
+        if (bank) {
+            logging_out(logging::debug) << "getting histogram '" << objectname << "' from bank entry "
+                                         << filename << std::endl;
+            auto th = bank->Get(filename + ":" + objectname);
+            if (!th) throw std::runtime_error("could not find '" + filename + ":" + objectname + "' in bank " + bank->GetFileName());
+            return th;
+        }
 
         logging_out(logging::debug) << "getting histogram '" << objectname << "' from file "
                                      << filename << std::endl;
@@ -162,9 +190,11 @@ namespace utils {
     /* Given a JSON configuration, and optionally a path to GERDA pdfs release,
      * return a list of pdfs for each configured "component". set
      * discard_user_files to true to forcibly ignore components defined by
-     * "user" (i.e. not part of the GERDa pdfs release) files.
+     * "user" (i.e. not part of the GERDa pdfs release) files. With a bank,
+     * gerda_pdfs is a folder inside it (user files are still read from disk).
      */
-    std::vector<bkg_comp> get_components_json(json& config, std::string gerda_pdfs = "", bool discard_user_files = false) {
+    std::vector<bkg_comp> get_components_json(json& config, std::string gerda_pdfs = "", bool discard_user_files = false,
+                                              const GerdaBank* bank = nullptr) {
         std::vector<bkg_comp> comp_map;
 
         // eventually get a global value for the gerda-pdfs path
@@ -177,7 +207,7 @@ namespace utils {
 
             /* START INTERMEZZO */
             // utility to sum over the requested parts (with weight) given isotope
-            auto sum_parts = [&it, &hist_name, &gerda_pdfs](std::string i, std::string hist_name_override = "") {
+            auto sum_parts = [&it, &hist_name, &gerda_pdfs, bank](std::string i, std::string hist_name_override = "") {
                 std::string true_iso = i;
                 if (i.find('-') != std::string::npos) true_iso = i.substr(0, i.find('-'));
 
@@ -210,7 +240,7 @@ namespace utils {
                         logging_out(logging::debug) << "summing object '" << hist_name << " with weight "
                                                      << p.value().get<double>()/sumw << std::endl;
                         // get histogram (owned by us)
-                        collection.emplace_back(utils::get_component(filename, hist_name, 8000, 0, 8000));
+                        collection.emplace_back(utils::get_component(filename, hist_name, 8000, 0, 8000, bank));
                         // apply weight
                         collection.back()->Scale(p.value().get<double>()/sumw);
                     }
@@ -228,7 +258,7 @@ namespace utils {
                     auto filename = gerda_pdfs + "/" + it["part"].get<std::string>() + "/" + true_iso + "/" + "pdf-"
                         + volume + "-" + part + "-" + i + ".root";
                     // get histogram (owned by us)
-                    auto thh = utils::get_component(filename, hist_name, 8000, 0, 8000);
+                    auto thh = utils::get_component(filename, hist_name, 8000, 0, 8000, bank);
                     return thh;
                 }
                 else throw std::runtime_error("unexpected 'part' value found in \"components\"");
@@ -247,17 +277,17 @@ namespace utils {
                         auto th = utils::get_component(filename, objname, 8000, 0, 8000);
                         th->SetName((iso.key() + "_" + std::string(th->GetName())).c_str());
 
-                        for (int b = 0; b <= th->GetNbinsX()+1; ++b) {
-                            if (th->GetBinContent(b) < 0) {
-                                logging_out(logging::warning) << "Negative bin content detected in pdf built for "
-                                                              << iso.key() << "in bin " << b
-                                                              << ", setting it to zero" << std::endl;
-                                th->SetBinContent(b, 0);
-                            }
+                        // clip negative bins and index the non-empty ones in one go
+                        std::vector<int> clipped;
+                        auto supp = sparse::clip_and_index(*th, clipped);
+                        for (auto b : clipped) {
+                            logging_out(logging::warning) << "Negative bin content detected in pdf built for "
+                                                          << iso.key() << "in bin " << b
+                                                          << ", setting it to zero" << std::endl;
                         }
 
                         // comp_map now owns the histogram
-                        comp_map.emplace_back(iso.key(), th.release(), objname, iso.value()["amount-cts"].get<float>());
+                        comp_map.emplace_back(iso.key(), th.release(), objname, iso.value()["amount-cts"].get<float>(), supp);
                     }
                     else {
                         logging_out(logging::debug) << "discard_user_files is set to true, discarding user-defined entry" << std::endl;
@@ -272,11 +302,14 @@ namespace utils {
                     }
 
                     if (iso.value()["isotope"].is_string()) {
+                        auto th = sum_parts(iso.value()["isotope"], hist_name_override);
+                        auto supp = sparse::index(*th);
                         comp_map.emplace_back(
                             iso.key(),
-                            sum_parts(iso.value()["isotope"], hist_name_override).release(),
+                            th.release(),
                             hist_name_override,
-                            iso.value()["amount-cts"].get<float>()
+                            iso.value()["amount-cts"].get<float>(),
+                            supp
                         );
                     }
                     else if (iso.value()["isotope"].is_object()) {
@@ -294,16 +327,15 @@ namespace utils {
                         // now sum them all
                         for (auto it = collection.begin()+1; it != collection.end(); it++) collection[0]->Add(it->get());
 
-                        // check for negative bin contents
-                        for (int b = 0; b <= collection[0]->GetNbinsX()+1; ++b) {
-                            if (collection[0]->GetBinContent(b) < 0) {
-                                logging_out(logging::warning) << "Negative bin content detected in pdf built for "
-                                    << iso.key() << "in bin " << b << ", setting it to zero" << std::endl;
-                                collection[0]->SetBinContent(b, 0);
-                            }
+                        // check for negative bin contents, while indexing the non-empty bins
+                        std::vector<int> clipped;
+                        auto supp = sparse::clip_and_index(*collection[0], clipped);
+                        for (auto b : clipped) {
+                            logging_out(logging::warning) << "Negative bin content detected in pdf built for "
+                                << iso.key() << "in bin " << b << ", setting it to zero" << std::endl;
                         }
 
-                        comp_map.emplace_back(iso.key(), collection[0].release(), hist_name_override, iso.value()["amount-cts"].get<float>());
+                        comp_map.emplace_back(iso.key(), collection[0].release(), hist_name_override, iso.value()["amount-cts"].get<float>(), supp);
                     }
                     else throw std::runtime_error("unexpected entry " + iso.value()["isotope"].dump()
                             + "found in [\"components\"][\"" + iso.key() + "\"][\"isotope\"]");
@@ -315,9 +347,13 @@ namespace utils {
                 logging_out(logging::debug) << "inserted '" << comp_map.back().name
                                              << "' with histogram '" << comp_map.back().hist->GetName()
                                              << "' and number of counts = " << comp_map.back().counts
+                                             << " (support: " << comp_map.back().support.covered() << " bins in "
+                                             << comp_map.back().support.ranges.size() << " ranges)"
                                              << std::endl;
             }
         }
+        for (size_t i = 0; i < comp_map.size(); ++i) comp_map[i].id = i;
+
         return comp_map;
     }
 }